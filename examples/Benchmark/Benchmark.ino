@@ -0,0 +1,231 @@
+#include <Arduino.h>
+#include <M5GFX.h>
+#include <M5UnitLCD.h>
+
+/// Unitのファームウェアの処理性能を計測する。
+/// 決まった量の描画コマンドを送信し、処理し終えるまでの時間と READ_BUFSTAT の差分から次の値を表示する
+///   host   : 送信開始から処理完了までの受信Byte数/秒・コマンド数/秒
+///   isr    : I2C割込み処理の受信1Byteあたりの平均CPUサイクル数
+/// Unit側は platformio.ini の環境を切替えて書込み、同じ計測を行って比較する
+///   release          : 不定長コマンドをRX FIFOにまとめて受信する (バースト受信)、パースと描画・パネル転送を1コアで行う
+///   release_bytewise : 不定長コマンドも1Byte毎に割込みを受ける
+///   release_dualcore : パースと描画をCore0、パネル転送をCore1で行う
+
+static constexpr std::uint8_t CMD_SET_FLOWCTRL = 0x3D;
+static constexpr std::uint8_t CMD_READ_BUFSTAT = 0x0B;
+static constexpr std::size_t BUFSTAT_LEN = 28;
+static constexpr std::uint32_t I2C_FREQ = 400000;
+static constexpr std::int32_t LCD_WIDTH = 135;
+static constexpr std::int32_t LCD_HEIGHT = 240;
+
+M5GFX display;
+M5UnitLCD display2;
+static lgfx::Bus_I2C::config_t cfg;
+
+/// READ_BUFSTAT の値
+/// [0]コマンドバッファの空き [1]処理済みコマンド数 [2]受信Byte数 [3]処理待ちのコマンド数 [4]まとめて処理した回数 [5]1回の最大数 [6]I2C割込みのCPUサイクル数
+struct bufstat_t
+{
+  std::uint32_t v[BUFSTAT_LEN / 4];
+};
+
+/// 1回分の送信。受信側はフロー制御によりバッファの空きが少ない間アドレスにNACKを返すため、間隔を空けて送り直す
+static bool send(const std::uint8_t* data, std::size_t len)
+{
+  int retry = 0;
+  while (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, I2C_FREQ).has_error()
+      || lgfx::i2c::writeBytes(cfg.i2c_port, data, len).has_error()
+      || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+  {
+    lgfx::i2c::endTransaction(cfg.i2c_port);
+    if (++retry > 1000) { return false; }
+    delayMicroseconds(500);
+  }
+  return true;
+}
+
+static bool read_bufstat(bufstat_t* stat)
+{
+  std::uint8_t cmd = CMD_READ_BUFSTAT;
+  std::uint8_t buf[BUFSTAT_LEN];
+  int retry = 0;
+  while (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, I2C_FREQ).has_error()
+      || lgfx::i2c::writeBytes(cfg.i2c_port, &cmd, 1).has_error()
+      || lgfx::i2c::restart(cfg.i2c_port, cfg.i2c_addr, I2C_FREQ, true).has_error()
+      || lgfx::i2c::readBytes(cfg.i2c_port, buf, sizeof(buf)).has_error()
+      || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+  {
+    lgfx::i2c::endTransaction(cfg.i2c_port);
+    if (++retry > 1000) { return false; }
+    delayMicroseconds(500);
+  }
+  for (std::size_t i = 0; i < BUFSTAT_LEN / 4; ++i)
+  {
+    stat->v[i] = (std::uint32_t)buf[i * 4] << 24 | buf[i * 4 + 1] << 16 | buf[i * 4 + 2] << 8 | buf[i * 4 + 3];
+  }
+  return true;
+}
+
+/// 全画面を WRITE_RAW_16 で書込む。1行を1トランザクションで送る
+static bool workload_write_raw(std::size_t frame)
+{
+  std::uint8_t cmd[6] = { lgfx::Panel_M5UnitLCD::CMD_CASET, 0, LCD_WIDTH - 1
+                        , lgfx::Panel_M5UnitLCD::CMD_RASET, 0, LCD_HEIGHT - 1 };
+  if (!send(cmd, sizeof(cmd))) { return false; }
+  std::uint8_t line[1 + LCD_WIDTH * 2];
+  line[0] = lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_16;
+  for (std::int32_t y = 0; y < LCD_HEIGHT; ++y)
+  {
+    std::uint16_t color = lgfx::color565((std::uint8_t)(y + frame * 8), (std::uint8_t)(frame * 16), (std::uint8_t)(255 - y));
+    for (std::int32_t x = 0; x < LCD_WIDTH; ++x)
+    {
+      line[1 + x * 2] = color >> 8;
+      line[2 + x * 2] = color;
+    }
+    if (!send(line, sizeof(line))) { return false; }
+  }
+  return true;
+}
+
+/// 16x16の FILLRECT_16 を1フレームあたり画面全体に敷き詰める (8x15=120件)。32件を1トランザクションにまとめて送る
+static bool workload_fillrect(std::size_t frame)
+{
+  static constexpr std::size_t CMD_LEN = 7;
+  static constexpr std::size_t PER_TRANSACTION = 32;
+  std::uint8_t buf[CMD_LEN * PER_TRANSACTION];
+  std::size_t len = 0;
+  for (std::int32_t y = 0; y + 16 <= LCD_HEIGHT; y += 16)
+  {
+    for (std::int32_t x = 0; x + 16 <= LCD_WIDTH; x += 16)
+    {
+      std::uint16_t color = lgfx::color565((std::uint8_t)(x + frame * 8), (std::uint8_t)(y + frame * 4), (std::uint8_t)(frame * 32));
+      std::uint8_t* cmd = &buf[len];
+      cmd[0] = lgfx::Panel_M5UnitLCD::CMD_FILLRECT_16;
+      cmd[1] = x;
+      cmd[2] = y;
+      cmd[3] = x + 15;
+      cmd[4] = y + 15;
+      cmd[5] = color >> 8;
+      cmd[6] = color;
+      len += CMD_LEN;
+      if (len == sizeof(buf))
+      {
+        if (!send(buf, len)) { return false; }
+        len = 0;
+      }
+    }
+  }
+  return len == 0 || send(buf, len);
+}
+
+struct workload_t
+{
+  const char* name;
+  bool (*run)(std::size_t frame);
+  std::size_t frames;
+};
+
+static const workload_t workloads[] =
+{ { "write_raw", workload_write_raw, 20 }
+, { "fillrect" , workload_fillrect , 200 }
+};
+
+/// 計測結果を表示する。処理待ちのコマンドがなく、受信データも全てパースされ空き容量が計測前に戻った時点を完了とする
+static bool measure(const workload_t& w)
+{
+  bufstat_t before, after;
+  if (!read_bufstat(&before)) { return false; }
+  std::uint32_t start = micros();
+  for (std::size_t f = 0; f < w.frames; ++f)
+  {
+    if (!w.run(f)) { return false; }
+  }
+  do
+  {
+    if (!read_bufstat(&after)) { return false; }
+  } while (after.v[3] || after.v[0] < before.v[0]);
+  std::uint32_t us = micros() - start;
+
+  std::uint32_t commands = after.v[1] - before.v[1];
+  std::uint32_t bytes = after.v[2] - before.v[2];
+  std::uint32_t cycles = after.v[6] - before.v[6];
+  Serial.printf("%-10s %6u ms  host:%7u B/s %6u cmd/s  isr:%4u cycles/B\r\n"
+               , w.name, us / 1000
+               , (std::uint32_t)((std::uint64_t)bytes * 1000000 / us)
+               , (std::uint32_t)((std::uint64_t)commands * 1000000 / us)
+               , bytes ? cycles / bytes : 0);
+  display.printf("%s %u B/s %u cyc/B\n", w.name, (std::uint32_t)((std::uint64_t)bytes * 1000000 / us), bytes ? cycles / bytes : 0);
+  return true;
+}
+
+bool searchUnitLCD(void)
+{
+  auto board = display.getBoard();
+  if (board == m5gfx::board_t::board_M5Stack)
+  {
+    if (display2.init(21, 22)) return true;
+  }
+  else
+  if (board == m5gfx::board_t::board_M5Paper)
+  {
+    lgfx::gpio_hi(5);
+    lgfx::pinMode(5, lgfx::pin_mode_t::output);
+    if (display2.init(25, 32)) return true;
+  }
+  else
+  if (board == m5gfx::board_t::board_M5StickC
+  || board == m5gfx::board_t::board_M5StickCPlus
+  || board == m5gfx::board_t::board_M5StackCore2
+  || board == m5gfx::board_t::board_M5StackCoreInk
+    )
+  {
+    if (board == m5gfx::board_t::board_M5StackCore2)
+    {
+      m5gfx::i2c::writeRegister8( 1 , 0x34 , 0x12, 0x40, ~0x00); // EXTEN enable
+    }
+    if (display2.init(32, 33)) return true;
+  }
+  else
+  {
+    if (display2.init(26, 32)) return true; // ATOM
+    if (display2.init( 4, 13)) return true; // TimerCam
+  }
+
+  return false;
+}
+
+void setup(void)
+{
+  Serial.begin(115200);
+
+  display.init();
+  display.setEpdMode(lgfx::epd_mode_t::epd_fastest);
+
+  display.println("search UnitLCD.");
+  Serial.println("search UnitLCD.");
+  while (!searchUnitLCD())
+  {
+    delay(100);
+  }
+  auto panel = (lgfx::Panel_M5UnitLCD*)display2.getPanel();
+  auto bus = (lgfx::Bus_I2C*) panel->getBus();
+  cfg = bus->config();
+
+  /// 受信データを取りこぼさないよう、フロー制御を有効にして送信側を待たせる
+  std::uint8_t flowctrl[2] = { CMD_SET_FLOWCTRL, 1 };
+  send(flowctrl, sizeof(flowctrl));
+  delay(100);
+}
+
+void loop(void)
+{
+  for (auto& w : workloads)
+  {
+    if (!measure(w))
+    {
+      Serial.printf("%s : fail\r\n", w.name);
+      display.printf("%s : fail\n", w.name);
+    }
+  }
+  delay(5000);
+}
@@ -2,38 +2,250 @@
 #include <M5GFX.h>
 #include <M5UnitLCD.h>
 #include <esp_spi_flash.h>
+#include <mbedtls/sha256.h>
 
 #include "firmware.h"
+#include "crc32.hpp"
 
-M5GFX display;
-M5UnitLCD display2;
+/// compress_firmware.py で firmware_lz.h を生成しておくと、圧縮イメージを送信して受信側で展開させる
+#if __has_include("firmware_lz.h")
+#include "firmware_lz.h"
+#define USE_COMPRESSED_FIRMWARE 1
+#endif
+
+/// delta_firmware.py で firmware_delta.h を生成しておくと、Unitが差分の元のバージョンの場合は差分のみを送信する
+#if __has_include("firmware_delta.h")
+#include "firmware_delta.h"
+#define USE_DELTA_FIRMWARE 1
+#endif
 
-std::uint32_t _crc_table[256];
+static constexpr std::uint8_t CMD_UPDATE_BEGIN_EX = 0xF3;
+static constexpr std::uint8_t CMD_UPDATE_BEGIN_DELTA = 0xF4;
+static constexpr std::uint8_t CMD_UPDATE_HASH = 0xF5;
+static constexpr std::uint8_t CMD_UPDATE_RESUME = 0xF6;
+static constexpr std::uint8_t CMD_UPDATE_SEEK = 0xF7;
+static constexpr std::uint8_t CMD_UPDATE_BLOCKSIZE = 0xF8;
+static constexpr std::uint8_t CMD_UPDATE_DATA_SEQ = 0xF9;
+static constexpr std::uint8_t CMD_UPDATE_END_SHA = 0xFA;
+static constexpr std::uint8_t CMD_UPDATE_DATA_CONT = 0xFB;
+static constexpr std::uint8_t CMD_READ_HASH = 0x0E;
+static constexpr std::uint8_t CMD_READ_UPDATESTAT = 0x0F;
+static constexpr std::size_t HASH_MAX_SECTORS = 7;
+static constexpr std::size_t PIECE_SIZE = 1024;       // 順番付きブロックを分割して送る1トランザクションあたりのデータ量 (受信側のバッファの空きが少ない間のNACKがブロックの途中でも効くように)
 
-static void initCRCtable(void)
+/// アップデートの受信状態を読出す。対応していないファームウェアの場合はfalseを返す
+/// [0]直近のブロックの結果 [1]ブロックサイズ(2を底) [2-3]次に受付けるブロックの順番 [4]応答を待たずに送信してよいブロック数 [5]書込み待ちの数 [6-7]破棄したブロックの数
+static bool read_update_stat(const lgfx::Bus_I2C::config_t& cfg, std::uint8_t* stat)
 {
-  std::size_t i = 0;
-  do
+  std::uint8_t cmd = CMD_READ_UPDATESTAT;
+  /// 受信側はバッファの空きが少ない間アドレスにNACKを返すため、間隔を空けて送り直す
+  int retry = 0;
+  while (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+      || lgfx::i2c::writeBytes(cfg.i2c_port, &cmd, 1).has_error()
+      || lgfx::i2c::restart(cfg.i2c_port, cfg.i2c_addr, 400000, true).has_error()
+      || lgfx::i2c::readBytes(cfg.i2c_port, stat, 8).has_error()
+      || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
   {
-    std::uint32_t c = i << 24;
-    std::size_t j = 0;
-    do
+    lgfx::i2c::endTransaction(cfg.i2c_port);
+    if (++retry > 50) { return false; }
+    delay(2);
+  }
+  return (stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK
+       || stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY
+       || stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR
+       || stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BROKEN)
+      && stat[1] >= 12 && stat[1] <= 16 && stat[4] != 0;
+}
+
+/// UPDATE_END / UPDATE_END_SHA の結果を待つ。成功したUnitは再起動して応答しなくなり、失敗した場合はERRORを返す
+/// 結果は READ_UPDATESTAT の[0]、従来の手順では UPDATE_END の直後に続けて行う1Byteのリードで読出す (照合中はBUSY)
+static bool wait_update_end(const lgfx::Bus_I2C::config_t& cfg, bool extended)
+{
+  for (int retry = 0; retry < 1000; ++retry)
+  {
+    delay(20);
+    std::uint8_t result[8];
+    bool answered;
+    if (extended)
+    {
+      answered = read_update_stat(cfg, result);
+    }
+    else
+    {
+      answered = !lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000, true).has_error()
+              && !lgfx::i2c::readBytes(cfg.i2c_port, result, 1).has_error();
+      lgfx::i2c::endTransaction(cfg.i2c_port);
+    }
+    if (!answered) { return true; }
+    if (result[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR)
+    {
+      Serial.println("update end fail");
+      return false;
+    }
+  }
+  /// 応答を続けたまま再起動しない場合は失敗とする
+  return false;
+}
+
+/// 1トランザクション分の送信。受信側はバッファの空きが少ない間アドレスにNACKを返すため、間隔を空けて送り直す
+static bool send_piece(const lgfx::Bus_I2C::config_t& cfg, const std::uint8_t* head, std::size_t head_len, const std::uint8_t* data, std::size_t len)
+{
+  int retry = 0;
+  while (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+      || lgfx::i2c::writeBytes(cfg.i2c_port, head, head_len).has_error()
+      || lgfx::i2c::writeBytes(cfg.i2c_port, data, len).has_error()
+      || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+  {
+    lgfx::i2c::endTransaction(cfg.i2c_port);
+    if (++retry > 500) { return false; }
+    delay(2);
+  }
+  return true;
+}
+
+/// 順番付きのブロックを応答を待たずに送信する。受信側が次に受付ける順番を読出し、破棄されたブロックから送り直す
+static bool send_blocks_windowed(const lgfx::Bus_I2C::config_t& cfg, const std::uint8_t* image, std::size_t length)
+{
+  /// 応答を待たずに2ブロック以上送信できる中で最大のブロックサイズを選ぶ (64KB/16KB/4KBの順に試す)
+  /// ウィンドウが1では1ブロック毎に応答を待つことになり、順番付きブロックで送る意味がない
+  static constexpr std::uint8_t shifts[] = { 16, 14, 12 };
+  std::uint8_t stat[8];
+  for (auto shift : shifts)
+  {
+    std::uint8_t cmd[5] = { CMD_UPDATE_BLOCKSIZE, 0x77, 0x89, CMD_UPDATE_BLOCKSIZE, shift };
+    if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+     || lgfx::i2c::writeBytes(cfg.i2c_port, cmd, 5).has_error()
+     || lgfx::i2c::endTransaction(cfg.i2c_port).has_error()
+     || (delay(10), !read_update_stat(cfg, stat)))
+    {
+      return false;
+    }
+    if (stat[4] > 1) { break; }
+  }
+  std::size_t block_size = 1 << stat[1];
+  std::size_t window = stat[4];
+  if (window < 2)
+  {
+    Serial.printf("window:%d is too small\r\n", window);
+    return false;
+  }
+  std::size_t block = (length + block_size - 1) / block_size;
+  Serial.printf("block size:%d window:%d\r\n", block_size, window);
+
+  std::size_t sent = 0;
+  std::size_t acked = 0;
+  std::size_t rewound = ~0u;
+  int stall = 0;
+  while (acked < block)
+  {
+    if (sent < block && sent - acked < window)
+    {
+      std::size_t offset = sent * block_size;
+      std::size_t len = std::min(block_size, length - offset);
+      auto crc = crc::calc32(crc::CRC32_INIT, &image[offset], len);
+      std::uint8_t header[10] = { CMD_UPDATE_DATA_SEQ, 0x77, 0x89, CMD_UPDATE_DATA_SEQ
+                                , (std::uint8_t)(crc >> 24), (std::uint8_t)(crc >> 16), (std::uint8_t)(crc >> 8), (std::uint8_t)crc
+                                , (std::uint8_t)(sent >> 8), (std::uint8_t)sent };
+      /// ブロックはPIECE_SIZE毎のトランザクションに分け、2つ目以降はUPDATE_DATA_CONTに続けて送る
+      static constexpr std::uint8_t cont = CMD_UPDATE_DATA_CONT;
+      for (std::size_t pos = 0; pos < len; pos += PIECE_SIZE)
+      {
+        if (!send_piece(cfg, pos ? &cont : header, pos ? 1 : sizeof(header), &image[offset + pos], std::min(PIECE_SIZE, len - pos)))
+        {
+          return false;
+        }
+      }
+      ++sent;
+      continue;
+    }
+
+    delay(5);
+    if (!read_update_stat(cfg, stat)) { return false; }
+    std::size_t next = stat[2] << 8 | stat[3];
+    if (stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR) { return false; }
+    if (next != acked)
+    {
+      acked = next;
+      stall = 0;
+      display.fillCircle( 10 + (display.width() - 20) * acked / block, 120, 4, TFT_GREEN );
+      if (!display.displayBusy())
+      {
+        display.display();
+      }
+    }
+    else if (++stall > 1000)
+    {
+      return false;
+    }
+    else if ((stall % 200) == 0)
+    { /// 応答が進まない場合は同じ位置からの送り直しを再度許可する
+      rewound = ~0u;
+    }
+    /// 破棄されたブロックがあれば、受付けられる順番から送り直す (同じ位置への送り直しは一度だけ)
+    if (stat[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BROKEN && sent > acked && rewound != acked)
     {
-        c = ( c << 1) ^ ( ( c & 0x80000000) ? 0x04C11DB7 : 0);
-    } while ( ++j < 8 );
-    _crc_table[i] = c;
-  } while ( ++i < 256 );
+      Serial.printf("resend from %d\r\n", acked);
+      sent = acked;
+      rewound = acked;
+    }
+  }
+  return true;
 }
 
-static uint32_t crc32(const std::uint8_t *buf, std::size_t len) {
-  std::uint32_t c = 0xffffffff;
-  for (std::size_t i = 0; i < len; i++)    {
-    c = (c << 8) ^ _crc_table[((c >> 24) ^ buf[i]) & 0xff];
+/// 前回中断したアップデートで書込み済みのセクタのうち、送信するイメージと一致するものを調べる。
+/// 先頭セクタは先頭16Byteが0xFFのまま書込まれているため対象外とし、常に送り直す
+static std::size_t find_written_sectors(const lgfx::Bus_I2C::config_t& cfg, const std::uint8_t* image, std::size_t length, bool* skip)
+{
+  std::size_t block = (length + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+  std::size_t count = 0;
+  static std::uint8_t sector[SPI_FLASH_SEC_SIZE];
+  for (std::size_t b = 1; b < block; b += HASH_MAX_SECTORS)
+  {
+    std::size_t n = std::min(HASH_MAX_SECTORS, block - b);
+    std::uint8_t cmd[4] = { CMD_UPDATE_HASH, (std::uint8_t)(b >> 8), (std::uint8_t)b, (std::uint8_t)n };
+    if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+     || lgfx::i2c::writeBytes(cfg.i2c_port, cmd, 4).has_error()
+     || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+    {
+      return 0;
+    }
+    std::uint8_t res[1 + HASH_MAX_SECTORS * 4];
+    int retry = 100;
+    do
+    {
+      delay(10);
+      cmd[0] = CMD_READ_HASH;
+      res[0] = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
+      if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+       || lgfx::i2c::writeBytes(cfg.i2c_port, cmd, 1).has_error()
+       || lgfx::i2c::restart(cfg.i2c_port, cfg.i2c_addr, 400000, true).has_error()
+       || lgfx::i2c::readBytes(cfg.i2c_port, res, 1 + n * 4).has_error()
+       || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+      {
+        return 0;
+      }
+    } while (res[0] == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY && --retry);
+    if (res[0] != lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK) { return 0; }
+
+    for (std::size_t i = 0; i < n; ++i)
+    { /// 書込み先のセクタは未使用部分が0xFFのため、同じ状態にして比較する
+      std::size_t offset = (b + i) * SPI_FLASH_SEC_SIZE;
+      std::size_t len = std::min<std::size_t>(SPI_FLASH_SEC_SIZE, length - offset);
+      memcpy(sector, &image[offset], len);
+      memset(&sector[len], 0xFF, SPI_FLASH_SEC_SIZE - len);
+      auto p = &res[1 + i * 4];
+      std::uint32_t hash = (std::uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+      skip[b + i] = (hash == crc::calc32(crc::CRC32_INIT, sector, SPI_FLASH_SEC_SIZE));
+      count += skip[b + i];
+    }
   }
-  return c;
+  return count;
 }
 
-bool update(void)
+M5GFX display;
+M5UnitLCD display2;
+
+bool update(std::uint8_t major, std::uint8_t minor)
 {
   display.fillScreen(TFT_WHITE);
   display.setCursor(0, 0);
@@ -50,27 +262,75 @@ bool update(void)
   auto cfg = bus->config();
 
   std::uint8_t readbuf[8] = { 0 };
+
+  /// 受信状態を読出せるファームウェアであれば、圧縮/差分・再開・順番付きブロックの各機能を使う
+  bool extended = read_update_stat(cfg, readbuf);
+
+  const std::uint8_t* image = firmware;
   std::size_t length = sizeof(firmware);
+  std::size_t image_size = sizeof(firmware);
+  std::uint8_t begin_cmd = lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN;
+#if defined ( USE_COMPRESSED_FIRMWARE )
+  if (extended)
+  {
+    image = firmware_lz;
+    length = sizeof(firmware_lz);
+    image_size = firmware_lz_image_size;
+    begin_cmd = CMD_UPDATE_BEGIN_EX;
+  }
+#endif
+#if defined ( USE_DELTA_FIRMWARE )
+  if (extended && major == firmware_delta_base_major && minor == firmware_delta_base_minor)
+  {
+    image = firmware_delta;
+    length = sizeof(firmware_delta);
+    image_size = firmware_delta_image_size;
+    begin_cmd = CMD_UPDATE_BEGIN_DELTA;
+  }
+#endif
   std::size_t block = (length + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
 
+  /// 無圧縮の場合は書込み済みのセクタを調べ、一致するセクタがあれば続きから再開する
+  static bool skip[(sizeof(firmware) + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE];
+  memset(skip, 0, sizeof(skip));
+  if (extended && begin_cmd == lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN)
+  {
+    std::size_t written = find_written_sectors(cfg, image, length, skip);
+    Serial.printf("written sectors : %d\r\n", written);
+    if (written) { begin_cmd = CMD_UPDATE_RESUME; }
+  }
+  std::size_t begin_len = (begin_cmd == CMD_UPDATE_BEGIN_EX || begin_cmd == CMD_UPDATE_BEGIN_DELTA) ? 12 : 8;
+
   /// ファームウェア更新コマンド列
-  std::uint8_t data[16] = { lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN, 0x77, 0x89, lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN };
+  std::uint8_t data[16] = { begin_cmd, 0x77, 0x89, begin_cmd };
   data[4] = length >> 24;
   data[5] = length >> 16;
   data[6] = length >>  8;
   data[7] = length >>  0;
+  /// 展開後のサイズ (UPDATE_BEGIN_EX / UPDATE_BEGIN_DELTA のみ)
+  data[ 8] = image_size >> 24;
+  data[ 9] = image_size >> 16;
+  data[10] = image_size >>  8;
+  data[11] = image_size >>  0;
 
   if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
-    || lgfx::i2c::writeBytes(cfg.i2c_port, data, 8).has_error()
+    || lgfx::i2c::writeBytes(cfg.i2c_port, data, begin_len).has_error()
     || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
   {
     return false;
   }
 
   delay(50);
-  data[3] = data[0] = lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA;
+
+  /// 再開時以外は順番付きのブロックで応答を待たずに送信する
+  if (extended && begin_cmd != CMD_UPDATE_RESUME)
+  {
+    if (!send_blocks_windowed(cfg, image, length)) { return false; }
+    block = 0;
+  }
 
   /// セクタブロック単位(4096Byte) でデータ送信を繰り返す
+  bool seek = false;
   for (std::size_t b = 0; b < block; ++b)
   {
     display.fillCircle( 10 + (display.width() - 20) * b / block, 120, 4, TFT_GREEN );
@@ -79,8 +339,28 @@ bool update(void)
       display.display();
     }
 
-    auto len = std::min<std::size_t>(SPI_FLASH_SEC_SIZE, length);
-    auto crc = crc32(&firmware[b * SPI_FLASH_SEC_SIZE], len);
+    if (b < sizeof(skip) && skip[b])
+    { /// 書込み済みのセクタは送信せず、次に送信するセクタへ書込み位置を移させる
+      seek = true;
+      continue;
+    }
+    if (seek)
+    {
+      seek = false;
+      std::size_t offset = b * SPI_FLASH_SEC_SIZE;
+      std::uint8_t cmd[8] = { CMD_UPDATE_SEEK, 0x77, 0x89, CMD_UPDATE_SEEK
+                            , (std::uint8_t)(offset >> 24), (std::uint8_t)(offset >> 16), (std::uint8_t)(offset >> 8), (std::uint8_t)offset };
+      if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
+       || lgfx::i2c::writeBytes(cfg.i2c_port, cmd, 8).has_error()
+       || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
+      {
+        return false;
+      }
+    }
+
+    data[3] = data[0] = lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA;
+    auto len = std::min<std::size_t>(SPI_FLASH_SEC_SIZE, length - b * SPI_FLASH_SEC_SIZE);
+    auto crc = crc::calc32(crc::CRC32_INIT, &image[b * SPI_FLASH_SEC_SIZE], len);
     data[4] = crc >> 24;  /// 送信するデータのCRC32
     data[5] = crc >> 16;
     data[6] = crc >>  8;
@@ -90,7 +370,7 @@ bool update(void)
     /// ヘッダおよびデータブロック送信
     if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
     || lgfx::i2c::writeBytes(cfg.i2c_port, data, 8).has_error()
-    || lgfx::i2c::writeBytes(cfg.i2c_port, &firmware[b * SPI_FLASH_SEC_SIZE], len).has_error()
+    || lgfx::i2c::writeBytes(cfg.i2c_port, &image[b * SPI_FLASH_SEC_SIZE], len).has_error()
     || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
     {
       Serial.println("fail");
@@ -115,21 +395,33 @@ bool update(void)
       Serial.printf("fail:%02x\r\n", readbuf[0]);
       return false;
     }
-    length -= len;
   }
 
-  data[3] = data[0] = lgfx::Panel_M5UnitLCD::CMD_UPDATE_END;
+  /// 展開後のイメージ全体のSHA-256を送り、Unit側で書込んだ内容を読み戻して照合させる (一致しなければ起動先は切替わらない)
+  std::uint8_t end_cmd[4 + 32] = { lgfx::Panel_M5UnitLCD::CMD_UPDATE_END, 0x77, 0x89, lgfx::Panel_M5UnitLCD::CMD_UPDATE_END };
+  std::size_t end_len = 4;
+  if (extended)
+  {
+    end_cmd[3] = end_cmd[0] = CMD_UPDATE_END_SHA;
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, firmware, sizeof(firmware));
+    mbedtls_sha256_finish(&sha, &end_cmd[4]);
+    mbedtls_sha256_free(&sha);
+    end_len = sizeof(end_cmd);
+  }
 
   lgfx::i2c::endTransaction(cfg.i2c_port);
 
   if (lgfx::i2c::beginTransaction(cfg.i2c_port, cfg.i2c_addr, 400000).has_error()
-    || lgfx::i2c::writeBytes(cfg.i2c_port, data, 4).has_error()
+    || lgfx::i2c::writeBytes(cfg.i2c_port, end_cmd, end_len).has_error()
     || lgfx::i2c::endTransaction(cfg.i2c_port).has_error())
   {
     return false;
   }
 
-  return true;
+  return wait_update_end(cfg, extended);
 }
 
 bool searchUnitLCD(void)
@@ -175,8 +467,6 @@ void setup(void)
   display.init();
   display.setEpdMode(lgfx::epd_mode_t::epd_fastest);
 
-  initCRCtable();
-
   display.println("search UnitLCD.");
   Serial.println("search UnitLCD.");
   while (!searchUnitLCD())
@@ -208,7 +498,7 @@ void loop(void)
        || buf[3] != MINOR_VER)
       {
         display.startWrite();
-        if (update())
+        if (update(buf[2], buf[3]))
         {
           display.drawString("success", 0, 56);
           Serial.println("success");
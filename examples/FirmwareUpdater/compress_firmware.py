@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+# Copyright (c) M5Stack. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+"""firmware.bin を UPDATE_BEGIN_EX (0xF3) 用の圧縮イメージに変換し、C/C++のヘッダとして出力する
+
+形式 (src/image_decoder.hpp の展開処理と対応) :
+  LZSS : 制御Byte1つで8トークン、下位ビットから 1:リテラル1Byte 0:参照2Byte
+         参照は [0]=距離-1の下位8bit [1]上位4bit=距離-1の上位4bit 下位4bit=長さ-3 (距離1~4096 長さ3~18)
+  末尾4Byte : 展開後のイメージ全体のCRC32 (ビッグエンディアン)
+
+使い方 : python3 compress_firmware.py firmware.bin firmware_lz.h
+"""
+
+import sys
+
+WINDOW_SIZE = 4096
+MIN_MATCH = 3
+MAX_MATCH = 18
+MAX_CHAIN = 256
+
+
+def _make_crc_table():
+    table = []
+    for i in range(256):
+        c = i << 24
+        for _ in range(8):
+            c = ((c << 1) ^ 0x04C11DB7) if (c & 0x80000000) else (c << 1)
+        table.append(c & 0xFFFFFFFF)
+    return table
+
+
+_CRC_TABLE = _make_crc_table()
+
+
+def crc32(data, crc=0xFFFFFFFF):
+    """src/crc32.hpp と同じCRC32 (多項式0x04C11DB7 MSBファースト 初期値0xFFFFFFFF 最終XORなし)"""
+    for b in data:
+        crc = ((crc << 8) & 0xFFFFFFFF) ^ _CRC_TABLE[(crc >> 24) ^ b]
+    return crc
+
+
+def compress(data):
+    out = bytearray()
+    chains = {}
+    pos = 0
+    size = len(data)
+    while pos < size:
+        flag_index = len(out)
+        out.append(0)
+        flags = 0
+        for bit in range(8):
+            if pos >= size:
+                break
+            best_len = 0
+            best_dist = 0
+            if pos + MIN_MATCH <= size:
+                limit = min(MAX_MATCH, size - pos)
+                for cand in reversed(chains.get(data[pos:pos + MIN_MATCH], ())):
+                    dist = pos - cand
+                    if dist > WINDOW_SIZE:
+                        break
+                    n = MIN_MATCH
+                    while n < limit and data[cand + n] == data[pos + n]:
+                        n += 1
+                    if n > best_len:
+                        best_len = n
+                        best_dist = dist
+                        if n == limit:
+                            break
+            if best_len >= MIN_MATCH:
+                d = best_dist - 1
+                out.append(d & 0xFF)
+                out.append(((d >> 8) << 4) | (best_len - MIN_MATCH))
+                step = best_len
+            else:
+                flags |= 1 << bit
+                out.append(data[pos])
+                step = 1
+            for p in range(pos, pos + step):
+                if p + MIN_MATCH <= size:
+                    chain = chains.setdefault(data[p:p + MIN_MATCH], [])
+                    chain.append(p)
+                    if len(chain) > MAX_CHAIN:
+                        del chain[0]
+            pos += step
+        out[flag_index] = flags
+    return bytes(out)
+
+
+def decompress(payload):
+    out = bytearray()
+    i = 0
+    while i < len(payload):
+        flags = payload[i]
+        i += 1
+        for bit in range(8):
+            if i >= len(payload):
+                break
+            if flags & (1 << bit):
+                out.append(payload[i])
+                i += 1
+            else:
+                dist = (payload[i] | (payload[i + 1] >> 4) << 8) + 1
+                length = (payload[i + 1] & 0x0F) + MIN_MATCH
+                i += 2
+                for _ in range(length):
+                    out.append(out[-dist])
+    return bytes(out)
+
+
+def make_image(data):
+    crc = crc32(data)
+    return compress(data) + bytes([(crc >> 24) & 0xFF, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF])
+
+
+def write_header(path, image, image_size):
+    with open(path, "w") as f:
+        f.write("#pragma once\n\n")
+        f.write("/// compress_firmware.py で生成した圧縮イメージ (UPDATE_BEGIN_EX で送信する)\n")
+        f.write("static constexpr std::size_t firmware_lz_image_size = %d;\n\n" % image_size)
+        f.write("static constexpr unsigned char firmware_lz[%d] = {\n" % len(image))
+        for i in range(0, len(image), 16):
+            f.write("".join("0x%02x, " % b for b in image[i:i + 16]) + "\n")
+        f.write("};\n")
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    with open(argv[1], "rb") as f:
+        data = f.read()
+    image = make_image(data)
+    if decompress(image[:-4]) != data:
+        sys.stderr.write("self check failed\n")
+        return 1
+    write_header(argv[2], image, len(data))
+    print("%s : %d -> %d bytes (%.1f%%)" % (argv[1], len(data), len(image), len(image) * 100.0 / max(1, len(data))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
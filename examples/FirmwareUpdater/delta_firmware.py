@@ -0,0 +1,323 @@
+#!/usr/bin/env python3
+# Copyright (c) M5Stack. All rights reserved.
+# Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+"""旧ファームウェアから新ファームウェアへの差分を UPDATE_BEGIN_DELTA (0xF4) 用に生成し、C/C++のヘッダとして出力する
+
+形式 (src/image_decoder.hpp の展開処理と対応、数値はビッグエンディアン) :
+  先頭8Byte : 旧イメージのサイズ(4Byte) と CRC32(4Byte)。Unit側で実行中のパーティションと照合する
+  命令列    : 0x00~0x7F 挿入 続く(値+1)Byteをそのまま出力する
+              0x80~0xFF 複写 [0]下位7bit,[1-2]=長さ-1 [3-5]=旧イメージ内の位置
+  末尾4Byte : 新イメージ全体のCRC32
+
+使い方 : python3 delta_firmware.py old.bin new.bin firmware_delta.h MAJOR.MINOR
+           MAJOR.MINOR は old.bin のバージョン (Unitがこのバージョンの場合のみ差分を送信する)
+         python3 delta_firmware.py selftest [old.bin new.bin]
+           差分の生成と適用を往復させて結果が一致するか確認する。
+           C++コンパイラがあれば、生成した差分と圧縮イメージをUnitと同じ展開処理 (src/image_decoder.hpp) でも展開させる
+"""
+
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from compress_firmware import crc32, make_image
+
+BLOCK = 16          # 旧イメージを検索する際のキーの長さ
+MIN_COPY = 12       # これより短い一致は挿入として扱う (複写命令は6Byte)
+MAX_CANDIDATES = 8
+MAX_LITERAL = 128
+MAX_COPY = 1 << 23
+MAX_OFFSET = 1 << 24
+
+
+def _be32(value):
+    return bytes([(value >> 24) & 0xFF, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF])
+
+
+def _match_length(a, ai, b, bi, limit):
+    n = 0
+    step = 64
+    while n < limit:
+        l = min(step, limit - n)
+        if a[ai + n:ai + n + l] == b[bi + n:bi + n + l]:
+            n += l
+            continue
+        while n < limit and a[ai + n] == b[bi + n]:
+            n += 1
+        break
+    return n
+
+
+def make_delta(old, new):
+    if len(old) > MAX_OFFSET:
+        raise ValueError("base image too large")
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1):
+        cands = index.setdefault(old[i:i + BLOCK], [])
+        if len(cands) < MAX_CANDIDATES:
+            cands.append(i)
+
+    out = bytearray(_be32(len(old)) + _be32(crc32(old)))
+    literal = bytearray()
+
+    def flush_literal():
+        for i in range(0, len(literal), MAX_LITERAL):
+            chunk = literal[i:i + MAX_LITERAL]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+        del literal[:]
+
+    pos = 0
+    size = len(new)
+    while pos < size:
+        best_len = 0
+        best_src = 0
+        if pos + BLOCK <= size:
+            for src in index.get(new[pos:pos + BLOCK], ()):
+                n = _match_length(old, src, new, pos, min(len(old) - src, size - pos))
+                if n > best_len:
+                    best_len = n
+                    best_src = src
+        if best_len < MIN_COPY:
+            literal.append(new[pos])
+            pos += 1
+            continue
+        # 一致を挿入待ちのデータ側へも伸ばす
+        while literal and best_src > 0 and old[best_src - 1] == literal[-1]:
+            literal.pop()
+            best_src -= 1
+            best_len += 1
+            pos -= 1
+        flush_literal()
+        pos += best_len
+        while best_len:
+            n = min(best_len, MAX_COPY)
+            out.append(0x80 | ((n - 1) >> 16))
+            out.extend(bytes([((n - 1) >> 8) & 0xFF, (n - 1) & 0xFF]))
+            out.extend(bytes([(best_src >> 16) & 0xFF, (best_src >> 8) & 0xFF, best_src & 0xFF]))
+            best_src += n
+            best_len -= n
+    flush_literal()
+    out.extend(_be32(crc32(new)))
+    return bytes(out)
+
+
+def apply_delta(old, delta):
+    """src/image_decoder.hpp と同じ手順で差分を適用する"""
+    base_size = int.from_bytes(delta[0:4], "big")
+    base_crc = int.from_bytes(delta[4:8], "big")
+    if base_size != len(old) or crc32(old) != base_crc:
+        raise ValueError("base mismatch")
+    out = bytearray()
+    i = 8
+    end = len(delta) - 4
+    while i < end:
+        op = delta[i]
+        if op < 0x80:
+            out.extend(delta[i + 1:i + 2 + op])
+            i += 2 + op
+        else:
+            n = (((op & 0x7F) << 16) | (delta[i + 1] << 8) | delta[i + 2]) + 1
+            src = (delta[i + 3] << 16) | (delta[i + 4] << 8) | delta[i + 5]
+            if src + n > len(old):
+                raise ValueError("copy out of range")
+            out.extend(old[src:src + n])
+            i += 6
+    if crc32(out) != int.from_bytes(delta[end:], "big"):
+        raise ValueError("image crc mismatch")
+    return bytes(out)
+
+
+def write_header(path, delta, image_size, base_version):
+    major, minor = (int(v) for v in base_version.split("."))
+    with open(path, "w") as f:
+        f.write("#pragma once\n\n")
+        f.write("/// delta_firmware.py で生成した差分 (Unitのバージョンが一致する場合に UPDATE_BEGIN_DELTA で送信する)\n")
+        f.write("static constexpr std::uint8_t firmware_delta_base_major = %d;\n" % major)
+        f.write("static constexpr std::uint8_t firmware_delta_base_minor = %d;\n" % minor)
+        f.write("static constexpr std::size_t firmware_delta_image_size = %d;\n\n" % image_size)
+        f.write("static constexpr unsigned char firmware_delta[%d] = {\n" % len(delta))
+        for i in range(0, len(delta), 16):
+            f.write("".join("0x%02x, " % b for b in delta[i:i + 16]) + "\n")
+        f.write("};\n")
+
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "src")
+
+# src/image_decoder.hpp をホスト上で動かす検証プログラム
+# 使い方 : decoder lz|delta base.bin encoded.bin image_size out.bin chunk
+HARNESS = r"""
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "crc32.hpp"
+#include "image_decoder.hpp"
+
+static std::vector<std::uint8_t> base, out;
+
+struct sink_t
+{
+  static bool put(std::uint8_t value) { out.push_back(value); return true; }
+  static bool copy(std::size_t src, std::size_t len) { out.insert(out.end(), base.begin() + src, base.begin() + src + len); return true; }
+  static bool check_base(std::size_t size, std::uint32_t crc32)
+  {
+    return size == base.size() && crc::calc32(crc::CRC32_INIT, base.data(), size) == crc32;
+  }
+};
+
+static std::vector<std::uint8_t> load(const char* path)
+{
+  std::vector<std::uint8_t> res;
+  FILE* f = fopen(path, "rb");
+  if (!f) { return res; }
+  int c;
+  while ((c = fgetc(f)) != EOF) { res.push_back(c); }
+  fclose(f);
+  return res;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 7) { return 2; }
+  base = load(argv[2]);
+  std::vector<std::uint8_t> encoded = load(argv[3]);
+  std::size_t image_size = strtoul(argv[4], nullptr, 0);
+  std::size_t chunk = strtoul(argv[6], nullptr, 0);
+  static std::uint8_t window[image_decoder::LZ_WINDOW_SIZE];
+
+  image_decoder::decoder_t<sink_t> decoder;
+  decoder.reset(strcmp(argv[1], "lz") ? image_decoder::format_delta : image_decoder::format_lz
+               , encoded.size(), image_size, window);
+  /// Unitと同様にブロック単位で渡し、ブロックの境目をまたぐ展開状態も確認する
+  for (std::size_t pos = 0; pos < encoded.size(); pos += chunk)
+  {
+    std::size_t len = encoded.size() - pos < chunk ? encoded.size() - pos : chunk;
+    if (!decoder.input(&encoded[pos], len)) { puts(decoder.base_error() ? "base mismatch" : "decode error"); return 1; }
+  }
+  if (!decoder.finished() || decoder.outsize() != image_size
+   || crc::calc32(crc::CRC32_INIT, out.data(), out.size()) != decoder.trailer_crc())
+  {
+    puts("image mismatch");
+    return 1;
+  }
+  FILE* f = fopen(argv[5], "wb");
+  if (!f) { return 2; }
+  fwrite(out.data(), 1, out.size(), f);
+  fclose(f);
+  return 0;
+}
+"""
+
+
+class _Decoder:
+    """検証プログラムをビルドし、Unitと同じ展開処理でデータを展開する"""
+
+    def __init__(self):
+        self.dir = None
+        self.exe = None
+        cxx = shutil.which(os.environ.get("CXX", "c++"))
+        if cxx is None:
+            return
+        self.dir = tempfile.mkdtemp()
+        src = os.path.join(self.dir, "decoder.cpp")
+        with open(src, "w") as f:
+            f.write(HARNESS)
+        exe = os.path.join(self.dir, "decoder")
+        res = subprocess.run([cxx, "-std=gnu++11", "-O2", "-Wall", "-I", SRC_DIR, src, "-o", exe])
+        if res.returncode == 0:
+            self.exe = exe
+
+    def decode(self, fmt, base, encoded, image_size, chunk):
+        """展開できた場合はその内容を、展開を拒否した場合はNoneを返す"""
+        paths = [os.path.join(self.dir, n) for n in ("base.bin", "encoded.bin", "out.bin")]
+        for path, data in zip(paths, (base, encoded, b"")):
+            with open(path, "wb") as f:
+                f.write(data)
+        res = subprocess.run([self.exe, fmt, paths[0], paths[1], str(image_size), paths[2], str(chunk)], stdout=subprocess.DEVNULL)
+        if res.returncode != 0:
+            return None
+        with open(paths[2], "rb") as f:
+            return f.read()
+
+    def close(self):
+        if self.dir:
+            shutil.rmtree(self.dir)
+
+
+def _roundtrip(name, old, new, decoder):
+    delta = make_delta(old, new)
+    ok = apply_delta(old, delta) == new
+    if decoder.exe:
+        # 4KBと、命令の途中で区切れる半端なサイズのブロックで展開させる
+        ok = ok and all(decoder.decode("delta", old, delta, len(new), chunk) == new for chunk in (4096, 1021))
+        image = make_image(new)
+        ok = ok and all(decoder.decode("lz", b"", image, len(new), chunk) == new for chunk in (4096, 1021))
+    print("%-24s %s : %d -> %d bytes" % (name, "ok" if ok else "NG", len(new), len(delta)))
+    return ok
+
+
+def selftest(files):
+    rnd = random.Random(1)
+    base = bytes(rnd.getrandbits(8) for _ in range(200000))
+    edited = bytearray(base)
+    for _ in range(20):
+        p = rnd.randrange(len(edited))
+        edited[p:p + rnd.randrange(1, 300)] = bytes(rnd.getrandbits(8) for _ in range(rnd.randrange(0, 300)))
+    cases = [ ("identical", base, base)
+            , ("edited", base, bytes(edited))
+            , ("shifted", base, b"\xAA" * 1000 + base[:150000])
+            , ("unrelated", base[:5000], bytes(rnd.getrandbits(8) for _ in range(7000)))
+            , ("empty base", b"", base[:3000])
+            ]
+    if files:
+        with open(files[0], "rb") as f:
+            old = f.read()
+        with open(files[1], "rb") as f:
+            new = f.read()
+        cases.append(("files", old, new))
+    decoder = _Decoder()
+    if decoder.exe is None:
+        print("C++ compiler not available : src/image_decoder.hpp is not tested")
+    try:
+        ok = all([_roundtrip(*c, decoder=decoder) for c in cases])
+        try:
+            apply_delta(base[:-1], make_delta(base, base))
+            print("base mismatch not detected")
+            ok = False
+        except ValueError:
+            pass
+        if decoder.exe and decoder.decode("delta", base[:-1], make_delta(base, base), len(base), 4096) is not None:
+            print("base mismatch not detected by image_decoder.hpp")
+            ok = False
+    finally:
+        decoder.close()
+    print("selftest", "passed" if ok else "FAILED")
+    return 0 if ok else 1
+
+
+def main(argv):
+    if len(argv) >= 2 and argv[1] == "selftest":
+        return selftest(argv[2:4])
+    if len(argv) != 5:
+        sys.stderr.write(__doc__)
+        return 1
+    with open(argv[1], "rb") as f:
+        old = f.read()
+    with open(argv[2], "rb") as f:
+        new = f.read()
+    delta = make_delta(old, new)
+    if apply_delta(old, delta) != new:
+        sys.stderr.write("self check failed\n")
+        return 1
+    write_header(argv[3], delta, len(new), argv[4])
+    print("%s -> %s : %d -> %d bytes (%.1f%%)" % (argv[1], argv[2], len(new), len(delta), len(delta) * 100.0 / max(1, len(new))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -8,6 +8,8 @@
 #include <esp_sleep.h>
 #include <esp_pm.h>
 #include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 #include <nvs.h>
 #include <cstring>
@@ -18,12 +20,14 @@
 #include <lgfx/v1/platforms/esp32/Light_PWM.hpp>
 #include <lgfx/v1/platforms/esp32/Bus_SPI.hpp>
 
+#include "command_processor.hpp"  // DEBUG / DUAL_CORE の設定を先に読込む
 #include "common.hpp"
 #include "logo.hpp"
 #include "cpu_clock.hpp"
+#include "governor.hpp"
 #include "i2c_slave.hpp"
 #include "update.hpp"
-#include "command_processor.hpp"
+#include "dirty_region.hpp"
 
 namespace command_processor
 {
@@ -38,21 +42,157 @@ namespace command_processor
   static constexpr std::uint8_t I2C_DEFAULT_ADDR = 0x3E;
   static constexpr std::uint8_t I2C_MIN_ADDR = 0x08;
   static constexpr std::uint8_t I2C_MAX_ADDR = 0x77;
-  static constexpr std::size_t RX_BUFFER_MAX = 0x2000;
-  static constexpr std::size_t PARAM_MAXLEN = 12;
+  static constexpr std::size_t RX_BUFFER_SIZE = 0x8000;   // コマンドバッファのサイズ(Byte単位、2のべき乗)
+  static constexpr std::size_t RX_BUFCOUNT_SHIFT = 7;     // READ_BUFCOUNT応答用のシフト量 (RX_BUFFER_SIZE >> 7 == 256)
+  static constexpr std::size_t PARAM_MAXLEN = 36;      // 最長の固定長コマンド (UPDATE_END_SHA) に合わせる
+  static constexpr std::size_t RECORD_HEADER_LEN = 2;     // [0]コマンド [1]パラメータ長
+  static constexpr std::size_t RECORD_MAXLEN = 255;       // 1レコードあたりのパラメータ長の上限
+  static constexpr std::size_t RAW_BUFFER_SIZE = 0x2000;  // 受信データリングバッファのサイズ(Byte単位、2のべき乗)
+  static constexpr std::uint8_t RAW_MARK_BOUNDARY = 0;    // 受信データリングバッファ上のトランザクション区切り
+  static constexpr std::size_t RAW_REFUSE_FREE = RAW_BUFFER_SIZE / 4; // フロー制御時、空きがこれを下回ったら以降のトランザクションを断る (受付け済みの残りの受取り分)
+  static constexpr std::size_t RAW_RESUME_USED = RAW_BUFFER_SIZE / 4; // フロー制御時、使用量がこれを下回ったらI2C受信を再開する
+  static constexpr std::size_t UPDATE_BUFFERED = RAW_BUFFER_SIZE - RAW_REFUSE_FREE; // 順番付きブロックの受信データをupdateへ渡す前に溜めておけるByte数
+  /// 4KBのブロックでは圧縮/差分形式でも応答を待たずに2ブロック以上送信できるようにする (ウィンドウが1では1ブロック毎に応答待ちになる)
+  static_assert(UPDATE_BUFFERED >= 4096, "UPDATE_DATA_SEQ window must be at least 2 with 4KB blocks");
+  static constexpr std::size_t PARSE_RESERVE = 128;       // 受信データ1回分(32Byte)のパースに必要なコマンドバッファの空き
+  static constexpr std::size_t TX_STAGE_SIZE = 0x400;     // READ_RAW 応答の送信待ちバッファのサイズ(Byte単位、2のべき乗)
+  static constexpr std::size_t BATCH_MAX_COMMANDS = 64;   // 1回のループで連続処理するコマンド数の上限 (SET_BATCHの初期値)
+  static constexpr std::int32_t ALPHA_FILL_BOOST_PIXELS = 1024; // 透過付きの塗りでクロックを引上げる面積
+  static constexpr std::int64_t BATCH_TIME_US = 2000;     // 1回のループで連続処理する時間の上限(μs) (SET_BATCHの初期値)
+  static constexpr std::size_t ISR_REMAIN_STREAM = ~(std::size_t)0; // ISR側のコマンド追跡で、区切りまで読み飛ばす状態
+
+  /// Panel_M5UnitLCD に定義のない拡張コマンド
+  static constexpr std::uint8_t CMD_SET_BATCH = 0x34;      // 4Byte コマンドの連続処理の上限設定 [1]==コマンド数(0:初期値) [2-3]==時間μs (ビッグエンディアン 0:初期値)
+  static constexpr std::uint8_t CMD_SET_POWERTABLE = 0x35; // 4Byte クロック毎の消費電力設定 [1]==クロック(0:8MHz~6:240MHz) [2-3]==消費電力mW (ビッグエンディアン)
+  static constexpr std::uint8_t CMD_SET_FLUSHBAND = 0x37; // 2Byte パネル転送の分割設定 [1]== 0:分割しない 1~255:1回に転送する行数
+  static constexpr std::uint8_t CMD_SET_COLORDEPTH = 0x3B; // 2Byte フレームバッファおよびパネル転送の色深度設定 [1]== 16:RGB565 24:RGB888
+  static constexpr std::uint8_t CMD_SET_DOUBLEBUF = 0x3C; // 2Byte ダブルバッファ設定 [1]== 0:無効 1:有効
+  static constexpr std::uint8_t CMD_SET_FLOWCTRL = 0x3D;  // 2Byte フロー制御設定 [1]== 0:無効 1:バッファの空きが少ない間は新しいトランザクションにNACKを返す
+  static constexpr std::uint8_t CMD_READ_FLOWSTAT = 0x0A; // 1Byte フロー制御の統計読出し (4Byte×4 ビッグエンディアン)
+  static constexpr std::uint8_t CMD_READ_BUFSTAT = 0x0B;  // 1Byte バッファ状態の読出し (4Byte×7 ビッグエンディアン)
+  static constexpr std::uint8_t CMD_READ_FLUSHSTAT = 0x0C; // 1Byte パネル転送の統計読出し (4Byte×2 ビッグエンディアン + ダブルバッファ状態 + 色深度)
+  static constexpr std::uint8_t CMD_READ_HASH = 0x0E;     // 1Byte UPDATE_HASHの結果読出し [0]==UPDATE_RESULT [1-]==セクタ毎のCRC32 (ビッグエンディアン)
+  static constexpr std::uint8_t CMD_READ_UPDATESTAT = 0x0F; // 1Byte アップデートの受信状態の読出し (8Byte ビッグエンディアン)
+  static constexpr std::uint8_t CMD_READ_CLOCKSTAT = 0x0D; // 2Byte 動作クロックの統計読出し [1]==クロック(0:8MHz~6:240MHz) 0xFF:全体 (4Byte×4 ビッグエンディアン)
+  static constexpr std::uint8_t CMD_SET_FLUSHMODE = 0x3E; // 3Byte パネル転送の方針設定 [1]== 0:即時 1:コマンド処理待ちがなくなった時 2:COMMIT時 3:フレームレート上限 [2]==フレームレート(fps)
+  static constexpr std::uint8_t CMD_COMMIT = 0x3F;        // 1Byte 描画内容のパネルへの転送要求 (SET_FLUSHMODE 2 で使用)
+  static constexpr std::uint8_t CMD_UPDATE_BEGIN_EX = 0xF3; // 12Byte 圧縮イメージでのファームウェアアップデート準備 [1-3]==0x77,0x89,0xF3 [4-7]==圧縮データのサイズ [8-11]==展開後のサイズ (ビッグエンディアン)
+  static constexpr std::uint8_t CMD_UPDATE_BEGIN_DELTA = 0xF4; // 12Byte 差分でのファームウェアアップデート準備 [1-3]==0x77,0x89,0xF4 [4-7]==差分データのサイズ [8-11]==更新後のサイズ (ビッグエンディアン)
+  static constexpr std::uint8_t CMD_UPDATE_HASH = 0xF5;    // 4Byte 書込み先パーティションのセクタ毎のCRC32計算 [1-2]==先頭のセクタ番号 [3]==セクタ数(1~7) 結果はREAD_HASHで読出す
+  static constexpr std::uint8_t CMD_UPDATE_RESUME = 0xF6;  // 8Byte 書込み先の内容を残したまま無圧縮のアップデートを始める [1-3]==0x77,0x89,0xF6 [4-7]==イメージのサイズ
+  static constexpr std::uint8_t CMD_UPDATE_SEEK = 0xF7;    // 8Byte 次のUPDATE_DATAの書込み位置の変更 [1-3]==0x77,0x89,0xF7 [4-7]==位置 (セクタ境界)
+  static constexpr std::uint8_t CMD_UPDATE_BLOCKSIZE = 0xF8; // 5Byte UPDATE_DATA_SEQのブロックサイズ設定 [1-3]==0x77,0x89,0xF8 [4]==2を底とするサイズ 12:4KB 14:16KB 16:64KB (準備コマンドの直後に送る)
+  static constexpr std::uint8_t CMD_UPDATE_DATA_SEQ = 0xF9;  // 10Byte+ 順番付きのデータブロック [1-3]==0x77,0x89,0xF9 [4-7]==CRC32 [8-9]==ブロックの順番 以降ブロックのデータ
+  static constexpr std::uint8_t CMD_UPDATE_END_SHA = 0xFA;   // 36Byte イメージ全体のSHA-256を照合してアップデートを完了する [1-3]==0x77,0x89,0xFA [4-35]==SHA-256
+  static constexpr std::uint8_t CMD_UPDATE_DATA_CONT = 0xFB; // 1Byte+ 順番付きのデータブロックの続き 以降ブロックのデータ (UPDATE_DATA_SEQ/UPDATE_DATA_CONTのトランザクションの直後のみ)
+
+  /// コマンド毎の長さの表。パーサとISR側のコマンド追跡で共用し、両者の判定が食い違わないようにする
+  /// 値はコマンドByteを含む固定長部分の長さ。0は未定義のコマンド
+  static constexpr std::uint8_t CMDLEN_STREAM = 0x80; // 固定長部分の後に区切りまでデータが続くコマンド
+  static constexpr std::uint8_t CMDLEN_MASK = 0x7F;
+
+  namespace cmdlen
+  {
+    typedef lgfx::Panel_M5UnitLCD p;
+
+    constexpr bool in(std::uint8_t) { return false; }
+    template <typename... T>
+    constexpr bool in(std::uint8_t c, std::uint8_t v, T... rest) { return c == v || in(c, rest...); }
+
+    constexpr std::uint8_t entry(std::uint8_t c)
+    {
+      return in(c, p::CMD_READ_ID, p::CMD_READ_BUFCOUNT, p::CMD_INVOFF, p::CMD_INVON
+                 , p::CMD_READ_RAW_8, p::CMD_READ_RAW_16, p::CMD_READ_RAW_24
+                 , CMD_READ_FLOWSTAT, CMD_READ_BUFSTAT, CMD_READ_FLUSHSTAT, CMD_READ_HASH, CMD_READ_UPDATESTAT
+                 , CMD_COMMIT) ? 1
+           : in(c, p::CMD_BRIGHTNESS, p::CMD_ROTATE, p::CMD_SET_POWER, p::CMD_SET_SLEEP, p::CMD_SET_BYTESWAP
+                 , CMD_SET_COLORDEPTH, CMD_SET_DOUBLEBUF, CMD_SET_FLOWCTRL, CMD_SET_FLUSHBAND, CMD_READ_CLOCKSTAT) ? 2
+           : in(c, p::CMD_CASET, p::CMD_RASET, CMD_SET_FLUSHMODE) ? 3
+           : in(c, p::CMD_RESET, p::CMD_CHANGE_ADDR, p::CMD_UPDATE_END, CMD_SET_POWERTABLE, CMD_SET_BATCH, CMD_UPDATE_HASH) ? 4
+           : in(c, CMD_UPDATE_BLOCKSIZE) ? 5
+           : in(c, p::CMD_COPYRECT) ? 7
+           : in(c, p::CMD_UPDATE_BEGIN, CMD_UPDATE_RESUME, CMD_UPDATE_SEEK) ? 8
+           : in(c, CMD_UPDATE_BEGIN_EX, CMD_UPDATE_BEGIN_DELTA) ? 12
+           : in(c, CMD_UPDATE_END_SHA) ? 36
+           : in(c, p::CMD_SET_COLOR_8, p::CMD_SET_COLOR_16, p::CMD_SET_COLOR_24, p::CMD_SET_COLOR_32) ? 1 + (c & 7)
+           : in(c, p::CMD_DRAWPIXEL, p::CMD_DRAWPIXEL_8, p::CMD_DRAWPIXEL_16, p::CMD_DRAWPIXEL_24, p::CMD_DRAWPIXEL_32) ? 3 + (c & 7)
+           : in(c, p::CMD_FILLRECT, p::CMD_FILLRECT_8, p::CMD_FILLRECT_16, p::CMD_FILLRECT_24, p::CMD_FILLRECT_32) ? 5 + (c & 7)
+           : in(c, p::CMD_WRITE_RAW_8, p::CMD_WRITE_RAW_16, p::CMD_WRITE_RAW_24, p::CMD_WRITE_RAW_32, p::CMD_WRITE_RAW_A) ? CMDLEN_STREAM | (2 + ((c - 1) & 3))
+           : in(c, p::CMD_WRITE_RLE_8, p::CMD_WRITE_RLE_16, p::CMD_WRITE_RLE_24, p::CMD_WRITE_RLE_32, p::CMD_WRITE_RLE_A) ? CMDLEN_STREAM | (3 + ((c - 1) & 3))
+           : in(c, p::CMD_UPDATE_DATA) ? CMDLEN_STREAM | 8
+           : in(c, CMD_UPDATE_DATA_SEQ) ? CMDLEN_STREAM | 10
+           : in(c, CMD_UPDATE_DATA_CONT) ? CMDLEN_STREAM | 1
+           : 0;
+    }
+
+    template <std::size_t...> struct seq {};
+    template <std::size_t N, std::size_t... I> struct make_seq : make_seq<N - 1, N - 1, I...> {};
+    template <std::size_t... I> struct make_seq<0, I...> { typedef seq<I...> type; };
+
+    struct table_t
+    {
+      std::uint8_t v[256];
+    };
 
+    template <std::size_t... I>
+    constexpr table_t make_table(seq<I...>)
+    {
+      return table_t { { entry(I)... } };
+    }
+  }
+  /// ISRからも参照するためDRAMに置く
+  DRAM_ATTR static const cmdlen::table_t _command_length = cmdlen::make_table(cmdlen::make_seq<256>::type());
 
+  // コマンドバッファは (コマンド, パラメータ長, パラメータ) 形式のレコードをByte単位で詰めて格納するリングバッファ。
+  // WRITE_RAW / WRITE_RLE はピクセル毎ではなく、連続したピクセルデータを1レコードにまとめて格納する。
   volatile std::size_t _rx_buffer_setpos = 0;
   volatile std::size_t _rx_buffer_getpos = 0;
 
-  std::uint8_t _rx_buffer[RX_BUFFER_MAX][PARAM_MAXLEN];
-
-  std::uint8_t* _params = _rx_buffer[0];
+  std::uint8_t _rx_buffer[RX_BUFFER_SIZE];
+
+  // READ_BUFSTAT 用の積算値 (オーバーフローさせて差分で使う)
+  std::uint32_t _received_bytes = 0;   // I2Cで受信したByte数 (ISRで加算)
+  std::uint32_t _pushed_records = 0;   // コマンドバッファへ積んだレコード数 (パース側で加算)
+  std::uint32_t _executed_records = 0; // 処理したレコード数 (コマンド処理側で加算)
+  std::uint32_t _batch_count = 0;      // コマンドをまとめて処理した回数 (コマンド処理側で加算)
+  std::uint32_t _batch_max = 0;        // 1回にまとめて処理したコマンド数の最大値
+
+  std::size_t _batch_max_commands = BATCH_MAX_COMMANDS;
+  std::int64_t _batch_time_us = BATCH_TIME_US;
+
+  // 受信データリングバッファはISRが書込みメインタスクが読出す、I2Cの受信データそのものを溜めるリングバッファ。
+  // (データ長, データ) 形式で、データ長はISR 1回分の受信Byte数(1~32)、0はトランザクションの区切りを表す。
+  // コマンドのパースはメインタスク側で行い、ISRは読出し系コマンドの応答準備のみを行う。
+  volatile std::size_t _raw_buffer_setpos = 0;
+  volatile std::size_t _raw_buffer_getpos = 0;
+
+  std::uint8_t _raw_buffer[RAW_BUFFER_SIZE];
+  bool _raw_overflow = false; // 受信データを破棄した。トランザクションの区切りまで残りのデータも破棄する
+  bool _raw_closed = true;    // 最後に格納したのが区切りかどうか
+  bool _flowctrl = false;     // フロー制御の有効/無効
+  std::uint32_t _raw_dropped = 0; // 空きがなく破棄した受信データのByte数
+
+  // ISR側のコマンド追跡用の状態
+  std::uint8_t _isr_command = 0;
+  std::size_t _isr_remain = 0;      // 現在のコマンドの残りByte数
+  std::size_t _isr_param_index = 0;
+  std::uint8_t _isr_params[2];      // CASET / RASET の読出し範囲、読出し系コマンドの引数
+
+  std::uint8_t _params[PARAM_MAXLEN];
+  std::size_t _stream_len = 0;  // 格納途中の不定長コマンドレコードのパラメータ長
+  bool _stream_dropped = false; // 不定長コマンドのデータを破棄した。描画位置がずれないよう、区切りまで残りも破棄する
+  std::uint32_t _record_dropped = 0; // コマンドバッファに空きがなく破棄したByte数
   std::size_t _param_index = 0;
   std::size_t _param_need_count = 1;
   std::size_t _param_resetindex = 0;
   std::size_t _rle_abs = 0;
   std::uint32_t _argb8888 = ~0u;
+
+  // WRITE_RAW / WRITE_RLE の行単位書込み用の作業領域
+  std::uint32_t _span_argb[RECORD_MAXLEN];
+  std::uint32_t _span_colors32[(RECORD_MAXLEN + 3) / 4];
+  std::uint8_t* const _span_colors = (std::uint8_t*)_span_colors32;
+
   std::uint8_t _i2c_addr = I2C_DEFAULT_ADDR;
   lgfx::Panel_ST7789 _panel;
   lgfx::Light_PWM _light;
@@ -60,8 +200,66 @@ namespace command_processor
   LGFX_Device _lcd;
   LGFX_Sprite _canvas;
   bool _byteswap = false;
+  std::uint8_t _color_depth = 24;
 
   bool _modified = true;
+
+  // ダブルバッファ有効時のDMA転送元バッファ。描画は_canvasに行い、転送時に更新範囲のみをこちらへ複写する
+  std::uint8_t* _front_buffer = nullptr;
+
+  enum flush_mode_t
+  {
+    flush_immediate ,   // 転送可能になり次第転送する
+    flush_on_idle ,     // 処理待ちのコマンドがなくなった時点で転送する
+    flush_on_commit ,   // COMMITコマンドを処理した時点で転送する
+    flush_fixed_rate ,  // 指定したフレームレートを上限として転送する
+  };
+  /// 更新範囲はこの行数ずつに分けて転送し、合間にコマンド処理を進める
+  static constexpr std::uint_fast8_t FLUSH_BAND_DEFAULT = 24;
+  std::uint_fast8_t _flush_band = FLUSH_BAND_DEFAULT;
+  dirty_region::rect_t _flush_rects[dirty_region::MAX_RECTS]; // 転送中の範囲
+  const std::uint8_t* _flush_src = nullptr; // 転送元バッファ
+  std::size_t _flush_count = 0;  // 転送中の範囲の数
+  std::size_t _flush_index = 0;  // 次に転送する範囲の番号
+  std::int_fast16_t _flush_y = 0; // 次に転送する行
+
+  /// DMA転送の完了見込み時刻にタスクを起こすタイマ (Bus_SPIは完了通知を持たないため転送量から求める)
+  static constexpr std::uint32_t SPI_FREQ_WRITE = 40000000;
+  static constexpr std::int64_t SPI_TIMER_MIN_US = 20;  // 見込みより転送が長引いた場合の再確認間隔
+  esp_timer_handle_t _spi_timer = nullptr;
+  std::int64_t _spi_done_us = 0;  // 最後に開始したDMA転送の完了見込み時刻
+
+  flush_mode_t _flush_mode = flush_immediate;
+  std::int64_t _flush_interval_us = 0;
+  std::int64_t _last_flush_us = 0;
+  volatile bool _commit_requested = false;
+  volatile bool _flush_held = false;  // 転送すべき範囲があるが転送方針により保留中
+  std::uint32_t _flush_issued = 0;    // 転送を行った回数
+  std::uint32_t _flush_skipped = 0;   // 転送可能だったが転送方針により見送った回数
+
+#if DUAL_CORE == 1
+  // デュアルコア構成では Core0 がパースと描画(コマンド処理段)、Core1 が更新範囲の管理とDMA転送(転送段)を行う。
+  // 描画した範囲はコマンド1件ごとにまとめ、単一生産者/単一消費者のキューで転送段へ受渡す。
+  static constexpr std::size_t FLUSH_QUEUE_SIZE = 32;  // 2のべき乗
+  dirty_region::rect_t _flush_queue[FLUSH_QUEUE_SIZE];
+  volatile std::size_t _flush_queue_setpos = 0;
+  volatile std::size_t _flush_queue_getpos = 0;
+  dirty_region::rect_t _pending_dirty;       // キューへ未投入の描画範囲 (_modified が true の間有効)
+  volatile bool _flush_pause = false;        // コマンド処理段がパネルやバッファを直接操作する間、転送段を止める
+  volatile bool _flush_busy = false;         // 転送段が更新範囲やバッファを操作中
+  volatile bool _flush_idle = true;          // 転送段に未転送の範囲がなく、DMA転送も完了している
+  volatile bool _flush_queue_wait = false;   // コマンド処理段がキューの空きを待っている (転送段は受取り後に通知する)
+  volatile bool _setup_done = false;
+  TaskHandle_t _flush_task = nullptr;
+  TaskHandle_t _command_task = nullptr;
+#endif
+
+#if DEBUG == 1
+  // スループット計測用の積算値
+  std::uint32_t _bench_bytes = 0;    // パースした受信データのByte数
+  volatile std::uint32_t _bench_pixels = 0; // パネルへ転送したピクセル数
+  std::uint32_t _bench_batch_hist[8] = {0}; // バッチあたりのコマンド数の分布 [n] = 2^n ~ 2^(n+1)-1 件
+#endif
   bool _nvs_push = false;
 
   enum firmupdate_state_t
@@ -69,6 +267,7 @@ namespace command_processor
     nothing ,       // コマンド未受信
     wait_data ,     // データ待機
     progress ,      // データ受信中
+    wait_piece ,    // 順番付きのブロックの続き(UPDATE_DATA_CONT)の受信待ち
     sector_write ,  // セクタブロックのフラッシュ書き込み
     finish ,        // 全行程終了
   };
@@ -76,6 +275,12 @@ namespace command_processor
   std::size_t _firmupdate_index = 0;
   std::size_t _firmupdate_totalsize = 0;
   std::size_t _firmupdate_result = 0;
+
+  /// UPDATE_HASH の結果 (READ_HASHの応答がTX FIFO(32Byte)に収まる数まで)
+  static constexpr std::size_t HASH_MAX_SECTORS = 7;
+  std::uint32_t _hash_values[HASH_MAX_SECTORS];
+  std::size_t _hash_count = 0;
+  volatile std::uint8_t _hash_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
   std::size_t IRAM_ATTR _last_command = 0;
 
   std::uint_fast8_t _brightness = 128;
@@ -96,6 +301,18 @@ namespace command_processor
   std::uint_fast16_t _read_xptr = 0;
   std::uint_fast16_t _read_yptr = 0;
 
+  // READ_RAW の応答はメインタスクが1行ずつ要求形式に変換して送信待ちバッファに積み、ISRはFIFOへ複写するだけにする。
+  // 送信待ちバッファが尽きた場合はFIFOの残りを送らせてISRは補充を止め、メインタスクが変換後にFIFOへ直接書込んで再開させる。
+  // 送信待ちバッファの位置・FIFOへの書込み・応答の切替えは _read_mux で排他する。メインタスクは変換をロックの外で行い、
+  // その間に新しい READ_RAW で読出し位置が初期化された場合 (_read_serial が変わる) は変換結果を捨てる。
+  std::uint8_t _tx_stage[TX_STAGE_SIZE];
+  volatile std::size_t _tx_stage_setpos = 0;
+  volatile std::size_t _tx_stage_getpos = 0;
+  volatile bool _read_active = false;
+  std::uint32_t _read_serial = 0; // 読出し位置を初期化した回数
+  std::size_t _read_bytes = 3;  // 1ピクセルあたりの応答Byte数
+  portMUX_TYPE _read_mux = portMUX_INITIALIZER_UNLOCKED;
+
 
   #if DEBUG == 1
   std::uint8_t cmd_detect[256] = {0};
@@ -176,20 +393,277 @@ namespace command_processor
     }
   }
 
+  /// 動作速度の設定値を動作クロック選択の方針として反映する (0:低速 1:通常 2:高速)
   static void IRAM_ATTR set_power_mode(std::uint8_t mode)
   {
-    switch (mode)
+    governor::set_profile((governor::profile_t)mode);
+  }
+
+  /// コマンドバッファの空き容量(Byte数) 格納途中のレコードの分は除く
+  std::size_t IRAM_ATTR getBufferFree(void)
+  {
+    std::size_t res = (_rx_buffer_getpos - _rx_buffer_setpos - 1) & (RX_BUFFER_SIZE - 1);
+    std::size_t used = _stream_len ? RECORD_HEADER_LEN + _stream_len : 0;
+    return res > used ? res - used : 0;
+  }
+
+  /// コマンドバッファからレコードを1件取出す。戻り値はパラメータ長
+  static std::size_t IRAM_ATTR read_record(std::uint8_t* dst)
+  {
+    std::size_t gp = _rx_buffer_getpos;
+    dst[0] = _rx_buffer[gp];
+    std::size_t len = _rx_buffer[(gp + 1) & (RX_BUFFER_SIZE - 1)];
+    std::size_t pos = (gp + RECORD_HEADER_LEN) & (RX_BUFFER_SIZE - 1);
+    std::size_t first = std::min(len, RX_BUFFER_SIZE - pos);
+    memcpy(&dst[1], &_rx_buffer[pos], first);
+    memcpy(&dst[1 + first], _rx_buffer, len - first);
+    return len;
+  }
+
+  static void IRAM_ATTR write_ring(std::size_t pos, const std::uint8_t* src, std::size_t len)
+  {
+    for (std::size_t i = 0; i < len; ++i)
     {
-    case 0:  cpu_clock::set_clock_limit(cpu_clock::clock_20MHz,  cpu_clock::clock_20MHz ); break;
-    case 1:  cpu_clock::set_clock_limit(cpu_clock::clock_80MHz,  cpu_clock::clock_160MHz); break;
-    case 2:  cpu_clock::set_clock_limit(cpu_clock::clock_240MHz, cpu_clock::clock_240MHz); break;
+      _rx_buffer[(pos + i) & (RX_BUFFER_SIZE - 1)] = src[i];
     }
   }
 
-  std::size_t IRAM_ATTR getBufferFree(void)
+  /// キャンバスの座標をパネル座標に変換する (LGFX_Spriteの回転処理に合わせる)
+  static void IRAM_ATTR rotate_pos(std::int_fast16_t& x, std::int_fast16_t& y)
+  {
+    std::uint_fast8_t r = _canvas.getRotation() & 7;
+    if ((1u << r) & 0x96) { y = _canvas.height() - (y + 1); }
+    if (r & 2)            { x = _canvas.width()  - (x + 1); }
+    if (r & 1)            { std::swap(x, y); }
+  }
+
+  /// 描画を行った範囲(キャンバス座標)をパネルへの転送対象として記録する
+  static void IRAM_ATTR mark_dirty(std::int_fast16_t x, std::int_fast16_t y, std::int_fast16_t w, std::int_fast16_t h)
+  {
+    std::int_fast16_t xs = std::max<std::int_fast16_t>(x, 0);
+    std::int_fast16_t ys = std::max<std::int_fast16_t>(y, 0);
+    std::int_fast16_t xe = std::min<std::int_fast16_t>(x + w, _canvas.width()) - 1;
+    std::int_fast16_t ye = std::min<std::int_fast16_t>(y + h, _canvas.height()) - 1;
+    if (xs > xe || ys > ye) { return; }
+    rotate_pos(xs, ys);
+    rotate_pos(xe, ye);
+    if (xs > xe) { std::swap(xs, xe); }
+    if (ys > ye) { std::swap(ys, ye); }
+#if DUAL_CORE == 1
+    if (_modified)
+    { /// 転送段への受渡しはコマンド単位で行うため、それまでは外接矩形にまとめておく
+      xs = std::min(xs, _pending_dirty.xs);
+      ys = std::min(ys, _pending_dirty.ys);
+      xe = std::max(xe, _pending_dirty.xe);
+      ye = std::max(ye, _pending_dirty.ye);
+    }
+    _pending_dirty = { xs, ys, xe, ye };
+#else
+    dirty_region::add(xs, ys, xe, ye);
+#endif
+    _modified = true;
+  }
+
+  /// 未転送の描画範囲を破棄する (デュアルコア構成では panel_acquire 中に呼ぶこと)
+  static void discard_dirty(void)
+  {
+    _modified = false;
+    _flush_held = false;
+    dirty_region::clear();
+#if DUAL_CORE == 1
+    _flush_queue_getpos = _flush_queue_setpos;
+#endif
+  }
+
+  static bool flush_step(void);
+
+  /// コマンド処理段からパネルやバッファ構成を直接操作する前に、転送段を停止させてDMA転送の完了を待つ
+  static void panel_acquire(void)
+  {
+#if DUAL_CORE == 1
+    _flush_pause = true;
+    while (_flush_busy) { taskYIELD(); }
+#endif
+    /// 分割転送の途中であれば残りを送り切る
+    while (flush_step()) {}
+    _spi_bus.wait();
+  }
+
+  /// panel_acquire で停止させた転送段を再開させる
+  static void panel_release(void)
+  {
+#if DUAL_CORE == 1
+    _flush_pause = false;
+    xTaskNotifyGive(_flush_task);
+#endif
+  }
+
+  /// WRITE_RAW / WRITE_RLE の色データで描画色を更新する
+  static void IRAM_ATTR update_color(std::uint_fast8_t cmd, const std::uint8_t* data)
+  {
+    if ((cmd & 7) == (lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_A & 7))
+    { // アルファチャネルのみ
+      _argb8888 = (_argb8888 & 0xFFFFFF) | data[0] << 24;
+    }
+    else
+    {
+      update_argb8888(data, cmd & 7);
+    }
+  }
+
+  /// 描画範囲内の現在位置から、1行分を上限としてピクセル列をキャンバスへ転送する
+  static void IRAM_ATTR push_pixels(std::uint_fast8_t cmd, std::uint_fast16_t x, std::uint_fast16_t y, std::size_t len, const std::uint8_t* data)
   {
-    std::uint32_t res = (_rx_buffer_getpos - _rx_buffer_setpos) & (RX_BUFFER_MAX - 1);
-    return res ? res : RX_BUFFER_MAX;
+    mark_dirty(x, y, len, 1);
+    switch (cmd & 7)
+    {
+    case 1:
+      _canvas.pushImage(x, y, len, 1, (const lgfx::rgb332_t*)data);
+      return;
+
+    case 2:
+      if (_byteswap) { _canvas.pushImage(x, y, len, 1, (const lgfx::rgb565_t*)data); }
+      else           { _canvas.pushImage(x, y, len, 1, (const lgfx::swap565_t*)data); }
+      return;
+
+    case 3:
+      if (_byteswap) { _canvas.pushImage(x, y, len, 1, (const lgfx::rgb888_t*)data); }
+      else           { _canvas.pushImage(x, y, len, 1, (const lgfx::bgr888_t*)data); }
+      return;
+
+    case 4:
+      for (std::size_t i = 0; i < len; ++i, data += 4)
+      {
+        _span_argb[i] = _byteswap
+                      ? (data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0])
+                      : (data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]);
+      }
+      break;
+
+    default: // アルファチャネルのみ
+      {
+        std::uint32_t rgb = _argb8888 & 0xFFFFFF;
+        for (std::size_t i = 0; i < len; ++i)
+        {
+          _span_argb[i] = data[i] << 24 | rgb;
+        }
+      }
+      break;
+    }
+    _canvas.pushAlphaImage(x, y, len, 1, (const lgfx::argb8888_t*)_span_argb);
+  }
+
+  /// CASET/RASETで指定された描画範囲にピクセル列を書込み、描画位置を進める
+  static void IRAM_ATTR write_span(std::uint_fast8_t cmd, const std::uint8_t* data, std::size_t count)
+  {
+    if (_xs > _xe || _ys > _ye) { return; }
+    std::size_t bytes = 1 + ((cmd - 1) & 3);
+    std::uint_fast16_t xptr = _xptr;
+    std::uint_fast16_t yptr = _yptr;
+    do
+    {
+      auto len = std::min<std::uint32_t>(count, _xe + 1 - xptr);
+      push_pixels(cmd, xptr, yptr, len, data);
+      data += len * bytes;
+      xptr += len;
+      if (xptr > _xe)
+      {
+        xptr = _xs;
+        if (++yptr > _ye)
+        {
+          yptr = _ys;
+        }
+        _yptr = yptr;
+      }
+      count -= len;
+    } while (count);
+    _xptr = xptr;
+  }
+
+  /// CASET/RASETで指定された描画範囲を現在の描画色で指定ピクセル数だけ塗潰し、描画位置を進める
+  static void IRAM_ATTR fill_span(std::size_t length)
+  {
+    if (_xs > _xe || _ys > _ye) { return; }
+    std::uint8_t alpha = _argb8888 >> 24;
+    std::uint_fast16_t xptr = _xptr;
+    std::uint_fast16_t yptr = _yptr;
+    do
+    {
+      auto len = std::min<std::uint32_t>(length, _xe + 1 - xptr);
+      if (alpha)
+      {
+        mark_dirty(xptr, yptr, len, 1);
+        if (alpha == 0xFF)
+        {
+          _canvas.fillRect(xptr, yptr, len, 1, _argb8888);
+        }
+        else
+        {
+          _canvas.fillRectAlpha(xptr, yptr, len, 1, alpha, _argb8888);
+        }
+      }
+      xptr += len;
+      if (xptr > _xe)
+      {
+        xptr = _xs;
+        if (++yptr > _ye)
+        {
+          yptr = _ys;
+        }
+        _yptr = yptr;
+      }
+      length -= len;
+    } while (length);
+    _xptr = xptr;
+  }
+
+  /// ダブルバッファの有効/無効を切替える。メモリが確保できない場合はシングルバッファで動作する
+  static void set_double_buffer(bool enable)
+  {
+    _spi_bus.wait();
+    if (_front_buffer)
+    {
+      heap_caps_free(_front_buffer);
+      _front_buffer = nullptr;
+    }
+    if (enable)
+    {
+      _front_buffer = (std::uint8_t*)heap_caps_malloc(_canvas.bufferLength(), MALLOC_CAP_DMA);
+      if (_front_buffer == nullptr)
+      {
+        ESP_LOGE(LOGNAME, "double buffer alloc failed.");
+      }
+    }
+  }
+
+  /// フレームバッファとパネルの色深度を切替える。キャンバスは作り直されるため描画内容は消去される
+  static void set_color_depth(std::uint8_t depth)
+  {
+    depth = (depth == 16) ? 16 : 24;
+    if (_color_depth == depth) { return; }
+
+    bool double_buffer = (_front_buffer != nullptr);
+    set_double_buffer(false);  // 転送完了を待ってから転送用バッファを解放する
+    discard_dirty();
+
+    auto rotation = _canvas.getRotation();
+    _canvas.deleteSprite();
+    _lcd.setColorDepth(depth);
+    _canvas.setColorDepth(depth);
+    if (_canvas.createSprite(_lcd.width(), _lcd.height()) == nullptr)
+    { /// キャンバスを確保できない場合は元の色深度に戻す
+      ESP_LOGE(LOGNAME, "canvas alloc failed. depth:%d", depth);
+      depth = _color_depth;
+      _lcd.setColorDepth(depth);
+      _canvas.setColorDepth(depth);
+      _canvas.createSprite(_lcd.width(), _lcd.height());
+    }
+    _color_depth = depth;
+    _canvas.setRotation(rotation);
+    _canvas.fillScreen(TFT_BLACK);
+    mark_dirty(0, 0, _canvas.width(), _canvas.height());
+
+    set_double_buffer(double_buffer);
   }
 
   static bool IRAM_ATTR command(void)
@@ -198,7 +672,10 @@ namespace command_processor
     {
       return false;
     }
-    const std::uint8_t* params = _rx_buffer[_rx_buffer_getpos];
+    /// パラメータ部分(params[1]以降)が4Byte境界に揃うように配置する
+    static std::uint32_t record[1 + (RECORD_MAXLEN + 3) / 4];
+    std::uint8_t* params = &((std::uint8_t*)record)[3];
+    std::size_t params_len = read_record(params);
 
   #if DEBUG == 1
     if (cmd_detect[params[0]] == 0)
@@ -223,12 +700,16 @@ namespace command_processor
 
     case lgfx::Panel_M5UnitLCD::CMD_INVON:
       ESP_LOGI(LOGNAME, "CMD INV ON");
+      panel_acquire();
       _lcd.invertDisplay(true);
+      panel_release();
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_INVOFF:
       ESP_LOGI(LOGNAME, "CMD INV OFF");
+      panel_acquire();
       _lcd.invertDisplay(false);
+      panel_release();
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_SET_BYTESWAP:
@@ -244,8 +725,71 @@ namespace command_processor
       }
       break;
 
+    case CMD_SET_COLORDEPTH:
+      ESP_LOGI(LOGNAME, "CMD COLORDEPTH:%d", params[1]);
+      panel_acquire();
+      set_color_depth(params[1]);
+      panel_release();
+      break;
+
+    case CMD_SET_POWERTABLE:
+      cpu_clock::set_power_table((cpu_clock::cpu_clock_t)params[1], params[2] << 8 | params[3]);
+      break;
+
+    case CMD_UPDATE_HASH:
+      {
+        std::size_t count = std::min<std::size_t>(params[3], HASH_MAX_SECTORS);
+        bool res = count && update::hashSectors(params[1] << 8 | params[2], count, _hash_values);
+        _hash_count = res ? count : 0;
+        _hash_result = res ? lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK : lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
+      }
+      break;
+
+    case CMD_SET_BATCH:
+      ESP_LOGI(LOGNAME, "CMD BATCH:%d TIME:%d", params[1], params[2] << 8 | params[3]);
+      _batch_max_commands = params[1] ? params[1] : BATCH_MAX_COMMANDS;
+      _batch_time_us = (params[2] | params[3]) ? (params[2] << 8 | params[3]) : BATCH_TIME_US;
+      break;
+
+    case CMD_SET_FLUSHBAND:
+      ESP_LOGI(LOGNAME, "CMD FLUSHBAND:%d", params[1]);
+      _flush_band = params[1];
+      break;
+
+    case CMD_SET_FLUSHMODE:
+      ESP_LOGI(LOGNAME, "CMD FLUSHMODE:%d FPS:%d", params[1], params[2]);
+      _flush_mode = (params[1] <= flush_fixed_rate) ? (flush_mode_t)params[1] : flush_immediate;
+      _flush_interval_us = 1000000 / std::max<std::uint_fast8_t>(1, params[2]);
+      break;
+
+    case CMD_COMMIT:
+      /// 未転送の描画がなければ次のCOMMITまで転送しない
+#if DUAL_CORE == 1
+      _commit_requested = _modified || _flush_held || _flush_queue_getpos != _flush_queue_setpos;
+#else
+      _commit_requested = _modified;
+#endif
+      break;
+
+    case CMD_SET_FLOWCTRL:
+      ESP_LOGI(LOGNAME, "CMD FLOWCTRL:%d", params[1]);
+      _flowctrl = params[1];
+      if (!_flowctrl)
+      {
+        i2c_slave::resume_rx();
+      }
+      break;
+
+    case CMD_SET_DOUBLEBUF:
+      ESP_LOGI(LOGNAME, "CMD DOUBLEBUF:%d", params[1]);
+      panel_acquire();
+      set_double_buffer(params[1]);
+      panel_release();
+      break;
+
     case lgfx::Panel_M5UnitLCD::CMD_SET_SLEEP:
       ESP_LOGI(LOGNAME, "CMD SLEEP:%d", params[1]);
+      panel_acquire();
       if (params[1])
       {
         _lcd.sleep();
@@ -256,6 +800,7 @@ namespace command_processor
         _lcd.wakeup();
         _lcd.setBrightness(_brightness);
       }
+      panel_release();
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_SET_POWER:
@@ -303,6 +848,7 @@ namespace command_processor
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_COPYRECT:
+      governor::hint(cpu_clock::clock_240MHz);
       _canvas.copyRect( params[5]
                 , params[6]
                 , params[3] - params[1] + 1
@@ -310,7 +856,7 @@ namespace command_processor
                 , params[1]
                 , params[2]
                 );
-      _modified = true;
+      mark_dirty(params[5], params[6], params[3] - params[1] + 1, params[4] - params[2] + 1);
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_SET_COLOR_8:
@@ -339,7 +885,7 @@ namespace command_processor
       {
         _canvas.fillRectAlpha(_xs, _ys, 1, 1, _argb8888 >> 24, _argb8888);
       }
-      _modified = true;
+      mark_dirty(_xs, _ys, 1, 1);
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_FILLRECT_8:
@@ -378,9 +924,14 @@ namespace command_processor
       }
       else
       {
+        /// 透過付きの塗りは画素毎に合成するため、広い範囲では最大クロックで処理する
+        if ((_xe - _xs + 1) * (_ye - _ys + 1) >= ALPHA_FILL_BOOST_PIXELS)
+        {
+          governor::hint(cpu_clock::clock_240MHz);
+        }
         _canvas.fillRectAlpha(_xs, _ys, _xe - _xs + 1, _ye - _ys + 1, _argb8888 >> 24, _argb8888);
       }
-      _modified = true;
+      mark_dirty(_xs, _ys, _xe - _xs + 1, _ye - _ys + 1);
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_8:
@@ -394,89 +945,80 @@ namespace command_processor
     case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_32:
     case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_A:
       {
-        bool rle = (params[0] & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE;
-        std::uint8_t alpha;
-        if ((params[0] == lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_A)
-         || (params[0] == lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_A))
-        { // アルファチャネルのみ
-          alpha = params[rle + 1];
-          _argb8888 = (_argb8888 & 0xFFFFFF) | alpha << 24;
-        }
-        else
+        std::uint_fast8_t cmd = params[0];
+        std::size_t bytes = 1 + ((cmd - 1) & 3);
+        if ((cmd & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW)
         {
-          update_argb8888(&params[rle + 1], params[0] & 7);
-          alpha = _argb8888 >> 24;
+          /// レコード内のピクセルデータはまとめて行単位で書込む
+          std::size_t count = params_len / bytes;
+          if (count)
+          {
+            write_span(cmd, &params[1], count);
+            update_color(cmd, &params[1 + (count - 1) * bytes]);
+          }
         }
-        if (_xs <= _xe && _ys <= _ye)
+        else
         {
-          std::size_t length = rle ? params[1] : 1;
-          std::uint_fast16_t xptr = _xptr;
-          std::uint_fast16_t yptr = _yptr;
-          do
+          std::size_t unit = 1 + bytes;
+          std::size_t i = 1;
+          while (i + unit <= params_len + 1)
           {
-            auto len = std::min<std::uint32_t>(length, _xe + 1 - xptr);
-            if (alpha)
-            {
-              if (alpha == 0xFF)
-              {
-                _canvas.fillRect(xptr, yptr, len, 1, _argb8888);
-              }
-              else
-              {
-                _canvas.fillRectAlpha(xptr, yptr, len, 1, alpha, _argb8888);
-              }
+            if (params[i] != 1)
+            { // 同一色の連続は単色の塗潰しとして処理する
+              update_color(cmd, &params[i + 1]);
+              fill_span(params[i]);
+              i += unit;
+              continue;
             }
-            xptr += len;
-            if (xptr > _xe)
+            /// 長さ1のランが続く部分(直接モード)は色データを詰め直してまとめて書込む
+            std::size_t count = 0;
+            do
             {
-              xptr = _xs;
-              if (++yptr > _ye)
-              {
-                yptr = _ys;
-              }
-              _yptr = yptr;
-            }
-            length -= len;
-          } while (length);
-          _xptr = xptr;
+              memcpy(&_span_colors[count * bytes], &params[i + 1], bytes);
+              ++count;
+              i += unit;
+            } while (i + unit <= params_len + 1 && params[i] == 1);
+            write_span(cmd, _span_colors, count);
+            update_color(cmd, &_span_colors[(count - 1) * bytes]);
+          }
         }
       }
-      _modified = true;
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN:
-      _modified = false;
-      cpu_clock::request_clock_up(cpu_clock::clock_240MHz);
-      update::initCRCtable();
+    case CMD_UPDATE_BEGIN_EX:
+    case CMD_UPDATE_BEGIN_DELTA:
+    case CMD_UPDATE_RESUME:
+      panel_acquire();
+      discard_dirty();
+      governor::hint(cpu_clock::clock_240MHz);
       _lcd.fillScreen(TFT_WHITE);
       _lcd.drawString("update", 0, 0);
       _lcd.fillRect(10, 112, _lcd.width() - 20, 17, TFT_BLACK);
       _lcd.fillCircle(                10, 120, 8, TFT_BLACK);
       _lcd.fillCircle( _lcd.width() - 10, 120, 8, TFT_BLACK);
+      panel_release();
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA:
-      _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
-      _modified = false;
+      governor::hint(cpu_clock::clock_240MHz);
+      panel_acquire();
+      discard_dirty();
       ESP_LOGI(LOGNAME, "flash:%d", _firmupdate_index);
-      if (!update::writeBuffer(_firmupdate_index))
-      {
-        ESP_LOGE(LOGNAME, "OTA write fail");
-        _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
-      }
-      else
-      {
-        _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK;
-      }
-
-      _firmupdate_state = firmupdate_state_t::wait_data;
-      _firmupdate_index += SPI_FLASH_SEC_SIZE;
       _lcd.fillCircle( 10 + (_lcd.width() - 20) * _firmupdate_index / _firmupdate_totalsize, 120, 4, TFT_GREEN );
+      panel_release();
       //_nvs_push = false;
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_UPDATE_END:
-      if (update::end())
+    case CMD_UPDATE_END_SHA:
+      panel_acquire();
+      /// SHA-256付きの場合は書込んだイメージを読み戻して照合し、一致した場合のみ起動先を切替える
+      /// アップデートを始めていない場合は何もせずエラーとする
+      if (_firmupdate_state != firmupdate_state_t::nothing
+       && ((params[0] == CMD_UPDATE_END_SHA)
+          ? (params_len == 35 && params[1] == 0x77 && params[2] == 0x89 && params[3] == CMD_UPDATE_END_SHA && update::end(&params[4]))
+          : update::end()))
       {
         _lcd.drawString("success", 0, 144);
         ESP_LOGI(LOGNAME, "success! rebooting...");
@@ -486,17 +1028,50 @@ namespace command_processor
       else
       {
         ESP_LOGE(LOGNAME, "OTA close fail");
+        _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
       }
+      panel_release();
       break;
     }
 
-    _rx_buffer_getpos = (_rx_buffer_getpos + 1) & (RX_BUFFER_MAX - 1);
+    _rx_buffer_getpos = (_rx_buffer_getpos + RECORD_HEADER_LEN + params_len) & (RX_BUFFER_SIZE - 1);
+    ++_executed_records;
     return true;
   }
 
+  static void IRAM_ATTR spi_timer_cb(void* task)
+  {
+    xTaskNotifyGive((TaskHandle_t)task);
+  }
+
+  /// 実行中のDMA転送の完了見込み時刻にタスクへ通知するようタイマを設定する
+  static void IRAM_ATTR arm_spi_timer(void)
+  {
+    std::int64_t remain = _spi_done_us - esp_timer_get_time();
+    esp_timer_stop(_spi_timer);
+    esp_timer_start_once(_spi_timer, std::max(remain, SPI_TIMER_MIN_US));
+  }
+
+#if DUAL_CORE == 1
+  static std::size_t process_commands(void);
+  static void wait_event(std::size_t count);
+#endif
+
   static void IRAM_ATTR setupTask(void* masterHandler)
   {
+#if DUAL_CORE == 1
+    masterHandler = xTaskGetCurrentTaskHandle(); // I2C受信の通知はコマンド処理段のこのタスクで受ける
+#endif
     i2c_slave::init(I2C_PORT, PIN_SDA, PIN_SCL, _i2c_addr, masterHandler, ESP_INTR_FLAG_IRAM | ESP_INTR_FLAG_LEVEL3);
+#if DUAL_CORE == 1
+    /// デュアルコア構成ではこのタスクがそのままCore0のコマンド処理段になる
+    while (!_setup_done) { vTaskDelay(1); }
+    ulTaskNotifyTake( pdTRUE, 5000 / portTICK_PERIOD_MS );
+    for (;;)
+    {
+      wait_event(process_commands());
+    }
+#endif
     vTaskDelete(NULL);
   }
 
@@ -507,7 +1082,20 @@ namespace command_processor
 
     load_nvs();
 
+    { /// DMA転送完了の通知はパネルへの転送を行うこのタスクで受ける
+      esp_timer_create_args_t args = {};
+      args.callback = spi_timer_cb;
+      args.arg = xTaskGetCurrentTaskHandle();
+      args.name = "spi_done";
+      esp_timer_create(&args, &_spi_timer);
+    }
+
+#if DUAL_CORE == 1
+    _flush_task = xTaskGetCurrentTaskHandle();
+    xTaskCreatePinnedToCore(setupTask, "commandTask", 8192, nullptr, 1, &_command_task, 0);
+#else
     xTaskCreatePinnedToCore(setupTask, "setupTask", 8192, xTaskGetCurrentTaskHandle(), 0, NULL, 0);
+#endif
 
 #if DEBUG == 1
     lgfx::pinMode(0, lgfx::pin_mode_t::output);
@@ -523,7 +1111,7 @@ namespace command_processor
       auto cfg = _spi_bus.config();
       cfg.spi_host = VSPI_HOST;
       cfg.dma_channel = 2;
-      cfg.freq_write = 40000000;
+      cfg.freq_write = SPI_FREQ_WRITE;
       cfg.freq_read  = 14000000;
       cfg.pin_mosi = 15;
       cfg.pin_miso = 14;
@@ -568,20 +1156,25 @@ namespace command_processor
     _lcd.setCursor(0,216);
     _lcd.printf("Ver : %0d.%0d", FIRMWARE_MAJOR_VERSION, FIRMWARE_MINOR_VERSION);
     _brightness = _lcd.getBrightness();
-    _lcd.setColorDepth(24);
-    _canvas.setColorDepth (24);
+    _lcd.setColorDepth(_color_depth);
+    _canvas.setColorDepth (_color_depth);
 
-    _modified = true;
     _lcd.setRotation(0);
     _lcd.setWindow(0, 0, _lcd.width()-1, _lcd.height()-1);
     _canvas.createSprite(_lcd.width(), _lcd.height());
     _canvas.setRotation(0);
+    mark_dirty(0, 0, _canvas.width(), _canvas.height());
+    /// ダブルバッファはデフォルト無効。24bppのキャンバスと同じ大きさの転送用バッファはDMAメモリに確保できないことがある
 
     cpu_clock::init();
-    cpu_clock::request_clock_down(cpu_clock::clock_80MHz);
+    governor::init();
     set_power_mode(1);
 
+#if DUAL_CORE == 1
+    _setup_done = true;
+#else
     ulTaskNotifyTake( pdTRUE, 5000 / portTICK_PERIOD_MS );
+#endif
   /*
     auto ms = lgfx::millis();
     lgfx::pinMode(0, lgfx::pin_mode_t::input_pullup);
@@ -606,163 +1199,407 @@ namespace command_processor
   //*/
   }
 
-  /// メインループ処理 蓄積したコマンドの処理およびLCDへの出力処理
-  void IRAM_ATTR loop(void)
+  /// 分割転送の途中であれば、次の一帯をSPI DMA転送でパネルへ出力する。転送を行わなかった場合はfalseを返す
+  static bool IRAM_ATTR flush_step(void)
   {
-    ulTaskNotifyTake( pdTRUE, 0 );
-    if (!command() && !_modified && _firmupdate_state == firmupdate_state_t::nothing)
-    {
-      cpu_clock::request_clock_down(cpu_clock::clock_20MHz);
-      ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
-      cpu_clock::request_clock_up(cpu_clock::clock_240MHz);
-    }
-    if (_modified && !_spi_bus.busy())
+    if (_flush_index >= _flush_count) { return false; }
+
+    std::int_fast16_t width = _lcd.width();
+    std::size_t bytes = _canvas.bufferLength() / (width * _lcd.height());
+    std::size_t stride = width * bytes;
+    auto buf = _flush_src;
+    /// 小さな範囲は一帯の行数に収まる限りまとめて転送する
+    std::int_fast16_t lines = _flush_band ? _flush_band : _lcd.height();
+    do
     {
+      auto& r = _flush_rects[_flush_index];
+      std::int_fast16_t ys = _flush_y;
+      std::int_fast16_t ye = std::min<std::int_fast16_t>(r.ye, _flush_band ? ys + lines - 1 : r.ye);
 #if DEBUG == 1
-auto bf = (int)getBufferFree();
-memset(_canvas.getBuffer(), 0xFF, bf);
-memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
+      _bench_pixels += (r.xe - r.xs + 1) * (ye - ys + 1);
 #endif
-      _modified = false;
-      _lcd.setWindow(0, 0, _lcd.width()-1, _lcd.height()-1);
-      _spi_bus.writeBytes((std::uint8_t*)_canvas.getBuffer(), _canvas.bufferLength(), true, true);
-      //lcd.writePixels(static_cast<lgfx::swap565_t*>(sp.getBuffer()), sp.bufferLength()>>1);
-    }
+      _spi_bus.wait();
+      _lcd.setWindow(r.xs, ys, r.xe, ye);
+      if (r.xe - r.xs + 1 == width)
+      { /// 行全体の場合はバッファ上で連続しているので一度に転送する
+        _spi_bus.writeBytes(&buf[ys * stride], (ye - ys + 1) * stride, true, true);
+      }
+      else
+      {
+        std::size_t len = (r.xe - r.xs + 1) * bytes;
+        for (std::int_fast16_t y = ys; y <= ye; ++y)
+        {
+          _spi_bus.writeBytes(&buf[y * stride + r.xs * bytes], len, true, true);
+        }
+      }
+      /// 直前の転送は writeBytes 内で完了を待つため、完了見込みは最後の転送分だけでよい
+      std::size_t last = (r.xe - r.xs + 1) * bytes * ((r.xe - r.xs + 1 == width) ? (ye - ys + 1) : 1);
+      _spi_done_us = esp_timer_get_time() + (std::int64_t)last * 8000000 / SPI_FREQ_WRITE;
+      lines -= ye - ys + 1;
+      if (ye < r.ye) { _flush_y = ye + 1; }
+      else if (++_flush_index < _flush_count) { _flush_y = _flush_rects[_flush_index].ys; }
+    } while (_flush_index < _flush_count && (lines > 0 || !_flush_band));
+    return true;
   }
 
-  /// I2C STOP時などのデータの区切りの処理
-  void IRAM_ATTR closeData(void)
+  /// 更新範囲のみをSPI DMA転送でパネルへ出力する。最初の一帯を転送し、残りは flush_step で順次転送する
+  static void IRAM_ATTR flush(void)
   {
-    _param_index = 0;
-    _param_need_count = 1;
-    _param_resetindex = 0;
+    auto rects = _flush_rects;
+    std::size_t count = dirty_region::take(rects);
+
+    ++_flush_issued;
+    _last_flush_us = esp_timer_get_time();
+    _commit_requested = false;
+    _flush_held = false;
+
+    std::int_fast16_t width = _lcd.width();
+    std::size_t bytes = _canvas.bufferLength() / (width * _lcd.height());
+    std::size_t stride = width * bytes;
+    auto buf = (const std::uint8_t*)_canvas.getBuffer();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      auto& r = rects[i];
+      /// 幅が半分以上ある範囲は行全体を送ったほうが転送回数が少なく済む
+      if ((r.xe - r.xs + 1) * 2 >= width)
+      {
+        r.xs = 0;
+        r.xe = width - 1;
+      }
+    }
+    if (_front_buffer)
+    { /// 転送する範囲だけを描画用バッファから転送用バッファへ複写し、転送中も描画を続けられるようにする
+      _spi_bus.wait();
+      for (std::size_t i = 0; i < count; ++i)
+      {
+        auto& r = rects[i];
+        std::size_t offset = r.xs * bytes;
+        std::size_t len = (r.xe - r.xs + 1) * bytes;
+        if (len == stride)
+        {
+          offset = r.ys * stride;
+          memcpy(&_front_buffer[offset], &buf[offset], (r.ye - r.ys + 1) * stride);
+          continue;
+        }
+        for (std::int_fast16_t y = r.ys; y <= r.ye; ++y)
+        {
+          memcpy(&_front_buffer[y * stride + offset], &buf[y * stride + offset], len);
+        }
+      }
+      buf = _front_buffer;
+    }
+    _flush_src = buf;
+    _flush_count = count;
+    _flush_index = 0;
+    _flush_y = count ? rects[0].ys : 0;
+    flush_step();
   }
 
-  /// I2CペリフェラルISRから1Byteずつデータを受取る処理
-  bool IRAM_ATTR addData(std::uint8_t value)
-  {
-    _params[_param_index] = value;
 
-    if (++_param_index == 1)
+  /// 読出し位置 x,y から count ピクセルを要求形式に変換して dst[pos & mask] 以降へ書く。x,y は進めた位置に更新する
+  static std::size_t IRAM_ATTR convert_pixels(std::uint8_t* dst, std::size_t mask, std::size_t pos, std::size_t count, std::size_t bytes
+                                              , std::uint_fast16_t& x, std::uint_fast16_t& y)
+  {
+    for (std::size_t i = 0; i < count; ++i)
     {
-      _last_command = value;
-      _param_resetindex = 0;
-    
-      switch (value)
+      std::uint32_t res = _canvas.readPixelValue(x, y);
+      if (_color_depth == 16)
       {
-      default:
-        // 未定義のコマンドを受取った場合は通信が切れるまで残りの受信データを全て無視する。
-        _params[0] = lgfx::Panel_M5UnitLCD::CMD_NOP;
-        _param_need_count = PARAM_MAXLEN;
-        _param_resetindex = 1;
-        break;
-
-      case lgfx::Panel_M5UnitLCD::CMD_READ_ID:
-      case lgfx::Panel_M5UnitLCD::CMD_READ_BUFCOUNT:
-      case lgfx::Panel_M5UnitLCD::CMD_INVOFF:
-      case lgfx::Panel_M5UnitLCD::CMD_INVON:
-      case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_8:
-      case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_16:
-      case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_24:
-        _param_need_count = 1;
-        break;
-
-      case lgfx::Panel_M5UnitLCD::CMD_BRIGHTNESS:
-      case lgfx::Panel_M5UnitLCD::CMD_ROTATE:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_POWER:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_SLEEP:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_BYTESWAP:
-        _param_need_count = 2;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_CASET:
-      case lgfx::Panel_M5UnitLCD::CMD_RASET:
-        _param_need_count = 3;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_RESET:
-      case lgfx::Panel_M5UnitLCD::CMD_CHANGE_ADDR:
-      case lgfx::Panel_M5UnitLCD::CMD_UPDATE_END:
-        _param_need_count = 4;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_SET_COLOR_8:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_COLOR_16:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_COLOR_24:
-      case lgfx::Panel_M5UnitLCD::CMD_SET_COLOR_32:
-        _param_need_count = 1 + (value & 7);
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_COPYRECT:
-        _param_need_count = 7;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_DRAWPIXEL:
-      case lgfx::Panel_M5UnitLCD::CMD_DRAWPIXEL_8:
-      case lgfx::Panel_M5UnitLCD::CMD_DRAWPIXEL_16:
-      case lgfx::Panel_M5UnitLCD::CMD_DRAWPIXEL_24:
-      case lgfx::Panel_M5UnitLCD::CMD_DRAWPIXEL_32:
-        _param_need_count = 3 + (value & 7);
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_FILLRECT:
-      case lgfx::Panel_M5UnitLCD::CMD_FILLRECT_8:
-      case lgfx::Panel_M5UnitLCD::CMD_FILLRECT_16:
-      case lgfx::Panel_M5UnitLCD::CMD_FILLRECT_24:
-      case lgfx::Panel_M5UnitLCD::CMD_FILLRECT_32:
-        _param_need_count = 5 + (value & 7);
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_8:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_16:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_24:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_32:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW_A:
-        _param_need_count = 2 + ((value - 1) & 3);
-        _param_resetindex = 1;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_8:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_16:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_24:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_32:
-      case lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE_A:
-        _param_need_count = 3 + ((value - 1) & 3);
-        _param_resetindex = 1;
-        _rle_abs = 0;
-        return false;
-
-      case lgfx::Panel_M5UnitLCD::CMD_UPDATE_BEGIN:
-      case lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA:
-        _param_need_count = 8;
-        return false;
+        res = lgfx::color_convert<lgfx::bgr888_t, lgfx::swap565_t>(res);
       }
-    }
-    else
-    if (_param_index == 3 && (_params[0] & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE)
-    { // RLEエンコードされたピクセル情報の展開
-      if (_rle_abs)
+      switch (bytes)
       {
-        if (0 == --_rle_abs)
+        case 2: res = lgfx::color_convert<lgfx::swap565_t, lgfx::bgr888_t>(res); break;
+        case 1: res = lgfx::color_convert<lgfx::rgb332_t, lgfx::bgr888_t>(res); break;
+        default: break;
+      }
+      if (_byteswap)
+      {
+        switch (bytes)
         {
-          _param_resetindex = 1;
+          case 3: res = lgfx::getSwap24(res); break;
+          case 2: res = lgfx::getSwap16(res); break;
+          default: break;
         }
       }
-      else
-      if (_params[1] == 0) // enter abs_mode
+      std::size_t b = 0;
+      do
       {
-        _params[1] = 1;    // rle len = 1
-        _rle_abs = _params[2];
-        _param_index--;
-        _param_resetindex = 2;
+        dst[pos & mask] = res;
+        res >>= 8;
+        ++pos;
+      } while (++b < bytes);
+
+      if (++x > _read_xe)
+      {
+        x = _read_xs;
+        if (++y > _read_ye)
+        {
+          y = _read_ys;
+        }
+      }
+    }
+    return pos & mask;
+  }
+
+  /// 送信待ちバッファからTX FIFOの空き分を複写する (_read_mux 取得中に呼ぶ)。戻り値は送信待ちバッファに残ったByte数
+  /// 複写するデータがなければFIFOの空き割込みを止め、メインタスクが補充した時点で再開させる
+  static std::size_t IRAM_ATTR feed_txfifo(void)
+  {
+    std::size_t gp = _tx_stage_getpos;
+    std::size_t avail = (_tx_stage_setpos - gp) & (TX_STAGE_SIZE - 1);
+    std::size_t len = std::min(avail, i2c_slave::get_txfifo_free());
+    if (len == 0)
+    {
+      i2c_slave::stop_txdata();
+      return avail;
+    }
+    std::size_t first = std::min(len, TX_STAGE_SIZE - gp);
+    i2c_slave::add_txdata(&_tx_stage[gp], first);
+    if (first < len) { i2c_slave::add_txdata(_tx_stage, len - first); }
+    _tx_stage_getpos = (gp + len) & (TX_STAGE_SIZE - 1);
+    return avail - len;
+  }
+
+  /// 読出し範囲の現在の行の残りを送信待ちバッファへ積む (メインタスク)。戻り値は積んだピクセル数
+  static std::size_t IRAM_ATTR stage_readback(void)
+  {
+    if (!_read_active) { return 0; }
+    /// 読出し位置と空き容量だけをロック中に取得し、変換はロックの外で行う (送信待ちバッファへ書込むのはメインタスクのみ)
+    portENTER_CRITICAL(&_read_mux);
+    bool active = _read_active;
+    std::uint32_t serial = _read_serial;
+    std::uint_fast16_t x = _read_xptr;
+    std::uint_fast16_t y = _read_yptr;
+    std::size_t bytes = _read_bytes;
+    std::size_t sp = _tx_stage_setpos;
+    std::size_t free = (_tx_stage_getpos - sp - 1) & (TX_STAGE_SIZE - 1);
+    portEXIT_CRITICAL(&_read_mux);
+
+    std::size_t count = active ? std::min<std::size_t>(_read_xe - x + 1, free / bytes) : 0;
+    if (count == 0) { return 0; }
+    sp = convert_pixels(_tx_stage, TX_STAGE_SIZE - 1, sp, count, bytes, x, y);
+
+    portENTER_CRITICAL(&_read_mux);
+    bool publish = _read_active && serial == _read_serial;
+    if (publish)
+    { /// ISRが補充を止めていた場合に備え、FIFOの空き分はここで書込む
+      _tx_stage_setpos = sp;
+      _read_xptr = x;
+      _read_yptr = y;
+      feed_txfifo();
+    }
+    portEXIT_CRITICAL(&_read_mux);
+    return publish ? count : 0;
+  }
+
+  /// READ_RAW 受信時に送信待ちバッファと読出し位置を初期化する (ISR)
+  static void IRAM_ATTR start_readback(std::uint8_t cmd)
+  {
+    portENTER_CRITICAL_ISR(&_read_mux);
+    _tx_stage_getpos = _tx_stage_setpos;
+    _read_xptr = _read_xs;
+    _read_yptr = _read_ys;
+    _read_bytes = cmd & 3;
+    _read_active = true;
+    ++_read_serial;
+    portEXIT_CRITICAL_ISR(&_read_mux);
+  }
+
+  /// 格納途中の不定長コマンドレコードを確定し、処理側から見えるようにする
+  static void IRAM_ATTR publish_stream(void)
+  {
+    std::size_t len = _stream_len;
+    if (!len) { return; }
+    _stream_len = 0;
+    std::size_t sp = _rx_buffer_setpos;
+    _rx_buffer[sp] = _params[0];
+    _rx_buffer[(sp + 1) & (RX_BUFFER_SIZE - 1)] = len;
+    _rx_buffer_setpos = (sp + RECORD_HEADER_LEN + len) & (RX_BUFFER_SIZE - 1);
+    ++_pushed_records;
+  }
+
+  /// 不定長コマンドの1単位分(ピクセル/RLEラン)のデータを格納途中のレコードへ追記する
+  static inline __attribute__((always_inline)) void append_stream(const std::uint8_t* data, std::size_t len)
+  {
+    if (_stream_dropped)
+    {
+      _record_dropped += len;
+      return;
+    }
+    if (_stream_len + len > RECORD_MAXLEN)
+    {
+      publish_stream();
+    }
+    std::size_t free = (_rx_buffer_getpos - _rx_buffer_setpos - 1) & (RX_BUFFER_SIZE - 1);
+    if (free < RECORD_HEADER_LEN + _stream_len + len)
+    { // バッファに空きがない場合は破棄し、以降のデータも次の区切りまで破棄する (受信済みの分は確定しておく)
+      publish_stream();
+      _stream_dropped = true;
+      _record_dropped += len;
+      return;
+    }
+    write_ring(_rx_buffer_setpos + RECORD_HEADER_LEN + _stream_len, data, len);
+    _stream_len += len;
+  }
+
+  /// パラメータ付きのレコードをコマンドバッファに書込む
+  static void IRAM_ATTR push_record(std::uint8_t cmd, const std::uint8_t* data, std::size_t len)
+  {
+    publish_stream();
+    std::size_t sp = _rx_buffer_setpos;
+    std::size_t free = (_rx_buffer_getpos - sp - 1) & (RX_BUFFER_SIZE - 1);
+    if (free < RECORD_HEADER_LEN + len)
+    { // バッファに空きがない場合は破棄する
+      _record_dropped += 1 + len;
+      return;
+    }
+    _rx_buffer[sp] = cmd;
+    _rx_buffer[(sp + 1) & (RX_BUFFER_SIZE - 1)] = len;
+    write_ring(sp + RECORD_HEADER_LEN, data, len);
+    _rx_buffer_setpos = (sp + RECORD_HEADER_LEN + len) & (RX_BUFFER_SIZE - 1);
+    ++_pushed_records;
+  }
+
+  /// 受信済みのパラメータをコマンドバッファに確定し、次のコマンドの受信位置へ進める
+  static inline __attribute__((always_inline)) void commit_params(void)
+  {
+    std::size_t len = _param_index - 1;
+    _param_index = _param_resetindex;
+    if (_param_resetindex)
+    { // 不定長コマンドは受信した分をレコードに追記していく
+      append_stream(&_params[1], len);
+      return;
+    }
+    push_record(_params[0], &_params[1], len);
+  }
+
+  /// 受信データ内のトランザクション区切りの処理
+  static void IRAM_ATTR close_params(void)
+  {
+    publish_stream();
+    _stream_dropped = false;
+    if (_firmupdate_state == firmupdate_state_t::progress)
+    { /// 順番付きのブロックは、受信バッファを超えないよう分割されたトランザクションで続きを受取る。
+      /// 順番のないUPDATE_DATAは途中で途切れると続きを受付けられないためエラーとし、次のブロックのヘッダから受信し直す
+      if (_params[0] == CMD_UPDATE_DATA_SEQ)
+      {
+        _firmupdate_state = firmupdate_state_t::wait_piece;
+      }
+      else
+      {
+        _firmupdate_state = firmupdate_state_t::wait_data;
+        _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
+      }
+    }
+    _param_index = 0;
+    _param_need_count = 1;
+    _param_resetindex = 0;
+  }
+
+  /// 受信途中の順番付きのブロックを破棄し、送信側に送り直させる
+  static void IRAM_ATTR cancel_update_block(void)
+  {
+    _firmupdate_state = firmupdate_state_t::wait_data;
+    update::cancelBlock();
+    _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BROKEN;
+  }
+
+  /// ファームウェアのブロックを受信し終えた時の処理
+  static void IRAM_ATTR finish_update_block(void)
+  {
+    _param_index = 0;
+    _param_need_count = 1;
+    _param_resetindex = 0;
+    /// 次のブロックを続けて受信できるよう、書込みへ回すのはここで行う (書込み要求のキューが埋まっている場合のみ待つ)
+    /// コマンド処理側へは進捗の表示のみを依頼する
+    _firmupdate_state = firmupdate_state_t::wait_data;
+    switch (update::finishBlock())
+    {
+    case update::block_ok:
+      _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK;
+      _firmupdate_index = update::getPosition();
+      push_record(lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA, nullptr, 0);
+      break;
+
+    case update::block_broken:
+      _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BROKEN;
+      break;
+
+    default:
+      ESP_EARLY_LOGE(LOGNAME, "OTA write fail");
+      _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
+      break;
+    }
+  }
+
+  /// 受信データ1Byte分のパース処理
+  static inline __attribute__((always_inline)) void add_byte(std::uint8_t value)
+  {
+    _params[_param_index] = value;
+
+    if (++_param_index == 1)
+    {
+      _param_resetindex = 0;
+
+      if (_firmupdate_state == firmupdate_state_t::wait_piece)
+      { /// 分割された順番付きのブロックの続き。他のコマンドが割込んだ場合はブロックを破棄する
+        if (value == CMD_UPDATE_DATA_CONT)
+        {
+          _params[0] = CMD_UPDATE_DATA_SEQ;
+          _param_need_count = 2;
+          _param_resetindex = 1;
+          _firmupdate_state = firmupdate_state_t::progress;
+          return;
+        }
+        cancel_update_block();
+      }
+
+      std::uint_fast8_t len = (value == CMD_UPDATE_DATA_CONT) ? 0 : _command_length.v[value];
+      if (len == 0)
+      {
+        // 未定義のコマンドを受取った場合は通信が切れるまで残りの受信データを全て無視する。
+        _params[0] = lgfx::Panel_M5UnitLCD::CMD_NOP;
+        _param_need_count = PARAM_MAXLEN;
+        _param_resetindex = 1;
+      }
+      else
+      {
+        _param_need_count = len & CMDLEN_MASK;
+        /// WRITE_RAW / WRITE_RLE は2Byte目以降がピクセル毎の繰返しになる
+        if ((value & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW
+         || (value & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE)
+        {
+          _param_resetindex = 1;
+          _rle_abs = 0;
+        }
+        if (_param_need_count > 1) { return; }
+      }
+    }
+    else
+    if (_param_index == 3 && (_params[0] & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RLE)
+    { // RLEエンコードされたピクセル情報の展開
+      if (_rle_abs)
+      {
+        if (0 == --_rle_abs)
+        {
+          _param_resetindex = 1;
+        }
+      }
+      else
+      if (_params[1] == 0) // enter abs_mode
+      {
+        _params[1] = 1;    // rle len = 1
+        _rle_abs = _params[2];
+        _param_index--;
+        _param_resetindex = 2;
       }
     }
 
 
-
+
     if (_param_index >= _param_need_count)
     {
-      i2c_slave::clear_txdata();
       switch (_params[0])
       {
       default:
@@ -770,7 +1607,7 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
 
       case lgfx::Panel_M5UnitLCD::CMD_NOP:
         _param_index = _param_resetindex;
-        return false;
+        return;
 
       case lgfx::Panel_M5UnitLCD::CMD_RESET:
         if ((_params[1] == 0x77)
@@ -797,33 +1634,104 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
         }
         else
         {
-          closeData();
-          return false;
+          close_params();
+          return;
+        }
+        break;
+
+      /// 圧縮イメージ・差分でのファームウェアアップデートの準備コマンド (以降のデータ受信はUPDATE_DATAで行い、受信側で展開する)
+      case CMD_UPDATE_BEGIN_EX:
+      case CMD_UPDATE_BEGIN_DELTA:
+        if ((_params[1] == 0x77)
+         && (_params[2] == 0x89)
+         && (_params[0] == _params[3])
+        )
+        {
+          _firmupdate_state = firmupdate_state_t::wait_data;
+          _firmupdate_index = 0;
+          _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR; /// 途中中断した時のためリード応答にはエラーステートを設定しておく
+          _firmupdate_totalsize = _params[4] << 24 | _params[5] << 16 | _params[6] << 8 | _params[7];
+          update::begin( _firmupdate_totalsize
+                       , _params[0] == CMD_UPDATE_BEGIN_EX ? update::format_lz : update::format_delta
+                       , _params[8] << 24 | _params[9] << 16 | _params[10] << 8 | _params[11]);
+        }
+        else
+        {
+          close_params();
+          return;
+        }
+        break;
+
+      /// 中断したアップデートの再開コマンド。書込み先の内容を残し、一致済みのセクタはUPDATE_SEEKで読み飛ばさせる
+      /// (先頭セクタは先頭16バイトを退避する必要があるため必ず送り直させる)
+      case CMD_UPDATE_RESUME:
+        if ((_params[1] == 0x77)
+         && (_params[2] == 0x89)
+         && (_params[0] == _params[3])
+        )
+        {
+          _firmupdate_state = firmupdate_state_t::wait_data;
+          _firmupdate_index = 0;
+          _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR; /// 途中中断した時のためリード応答にはエラーステートを設定しておく
+          _firmupdate_totalsize = _params[4] << 24 | _params[5] << 16 | _params[6] << 8 | _params[7];
+          update::resume(_firmupdate_totalsize);
+        }
+        else
+        {
+          close_params();
+          return;
         }
         break;
 
+      /// 次に受信するブロックの書込み位置を変更するコマンド
+      case CMD_UPDATE_SEEK:
+        if ((_params[1] == 0x77)
+         && (_params[2] == 0x89)
+         && (_params[0] == _params[3])
+         && _firmupdate_state == firmupdate_state_t::wait_data
+        )
+        {
+          std::size_t offset = _params[4] << 24 | _params[5] << 16 | _params[6] << 8 | _params[7];
+          if (update::seek(offset))
+          {
+            _firmupdate_index = offset;
+          }
+          else
+          {
+            _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
+          }
+        }
+        close_params();
+        return;
+
+      /// データブロックのサイズ変更コマンド。受付けたサイズはREAD_UPDATESTATで確認させる
+      case CMD_UPDATE_BLOCKSIZE:
+        if ((_params[1] == 0x77)
+         && (_params[2] == 0x89)
+         && (_params[0] == _params[3])
+         && _firmupdate_state == firmupdate_state_t::wait_data
+         && _params[4] < 32
+        )
+        {
+          update::setBlockSize((std::size_t)1 << _params[4]);
+        }
+        close_params();
+        return;
+
       /// ファームウェアアップデートのデータ受信コマンド
       case lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA:
+      case CMD_UPDATE_DATA_SEQ:
         if (_firmupdate_state == firmupdate_state_t::progress)
         {
           /// 受信したデータをupdateに蓄積
-          if (update::addData(_params[1]))
+          update::addData(&_params[1], 1);
+          if (update::needData())
           {
             _param_index = _param_resetindex;
-            return false;
-          }
-
-          if (update::checkCRC32())
-          {
-            _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
+            return;
           }
-          else
-          {
-            _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BROKEN;
-          }
-          prepareTxData();
-          _firmupdate_state = sector_write;
-          closeData();
+          finish_update_block();
+          return;
         }
         else
         if ((_params[1] == 0x77)
@@ -832,18 +1740,26 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
         )
         {
           _nvs_push = true; // ファームウェア書き込み時はISRにイベントを起こさせない
-          update::setBlockCRC32( _params[4] << 24 | _params[5] << 16 | _params[6] << 8 | _params[7] );
+          std::uint32_t crc32 = _params[4] << 24 | _params[5] << 16 | _params[6] << 8 | _params[7];
+          if (_params[0] == CMD_UPDATE_DATA_SEQ)
+          { /// 順番の合わないブロックは読み捨てる (送信側はREAD_UPDATESTATで次に受付ける順番を確認して送り直す)
+            update::setBlock(_params[8] << 8 | _params[9], crc32);
+          }
+          else
+          {
+            update::setBlockCRC32(crc32);
+          }
           _param_need_count = 2;
           _param_resetindex = 1;
           _param_index = _param_resetindex;
           _firmupdate_state = firmupdate_state_t::progress;
-          _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR; /// 途中中断した時のためリード応答にはエラーステートを設定しておく
-          return false;
+          return;
         }
         else
         {
-          closeData();
-          return false;
+          _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_ERROR;
+          close_params();
+          return;
         }
         break;
 
@@ -860,49 +1776,568 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
         }
         break;
 
-      case lgfx::Panel_M5UnitLCD::CMD_CASET:
-        _read_xs = std::max<std::uint_fast16_t>(_params[1], 0);
-        _read_xe = std::min<std::uint_fast16_t>(_params[2], _canvas.width()-1);
-        break;
-
-      case lgfx::Panel_M5UnitLCD::CMD_RASET:
-        _read_ys = std::max<std::uint_fast16_t>(_params[1], 0);
-        _read_ye = std::min<std::uint_fast16_t>(_params[2], _canvas.height()-1);
-        break;
-
+      /// 読出し系のコマンドはISR側で処理済みのためレコードにしない
       case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_8:
       case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_16:
       case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_24:
-        _read_xptr = _read_xs;
-        _read_yptr = _read_ys;
-        prepareTxData();
-        closeData();
-        return false;
-
       case lgfx::Panel_M5UnitLCD::CMD_READ_ID:
       case lgfx::Panel_M5UnitLCD::CMD_READ_BUFCOUNT:
-        prepareTxData();
-        closeData();
-        return false;
+      case CMD_READ_FLOWSTAT:
+      case CMD_READ_BUFSTAT:
+      case CMD_READ_FLUSHSTAT:
+      case CMD_READ_CLOCKSTAT:
+      case CMD_READ_HASH:
+      case CMD_READ_UPDATESTAT:
+        _param_index = 0;
+        return;
       }
 
-      auto new_setpos = (_rx_buffer_setpos + 1) & (RX_BUFFER_MAX - 1);
-      _rx_buffer_setpos = new_setpos;
-      _param_index = _param_resetindex;
-      for (std::size_t i = 0; i < _param_resetindex; ++i)
+      commit_params();
+    }
+  }
+
+  /// 受信データリングバッファから取出したデータのパース処理
+  static void IRAM_ATTR parse_data(const std::uint8_t* data, std::size_t len)
+  {
+    const std::uint8_t* end = data + len;
+    while (data != end)
+    {
+      // ファームウェアのデータはバイト毎のパースを経由せず、受信したまとまりのままセクタバッファへ渡す
+      if (_firmupdate_state == firmupdate_state_t::progress
+       && _param_index == 1 && _param_resetindex == 1
+       && (_params[0] == lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA || _params[0] == CMD_UPDATE_DATA_SEQ))
       {
-        _rx_buffer[new_setpos][i] = _params[i];
+        data += update::addData(data, end - data);
+        if (!update::needData())
+        {
+          finish_update_block();
+        }
+        continue;
       }
-      _params = _rx_buffer[new_setpos];
+      // WRITE_RAWの連続データはswitchを経由せずピクセル単位でまとめて確定する
+      if (_param_index == 1 && _param_resetindex == 1
+       && (_params[0] & ~7) == lgfx::Panel_M5UnitLCD::CMD_WRITE_RAW)
+      {
+        std::size_t pixel_bytes = _param_need_count - 1;
+        if ((std::size_t)(end - data) >= pixel_bytes)
+        {
+          std::size_t len = (end - data) - ((end - data) % pixel_bytes);
+          do
+          {
+            std::size_t l = std::min(len, RECORD_MAXLEN - (RECORD_MAXLEN % pixel_bytes));
+            append_stream(data, l);
+            data += l;
+            len -= l;
+          } while (len);
+          continue;
+        }
+      }
+      add_byte(*data++);
+    }
+  }
 
+  /// ISRが受信データリングバッファに格納したデータを全てパースし、コマンドバッファへ積む
+  static void IRAM_ATTR parse_rx(void)
+  {
+    std::size_t gp = _raw_buffer_getpos;
+    std::size_t sp = _raw_buffer_setpos;
+    if (gp == sp) { return; }
+    do
+    {
+      std::size_t len = _raw_buffer[gp];
+      if (len != RAW_MARK_BOUNDARY && getBufferFree() < PARSE_RESERVE)
+      { // コマンドバッファに空きがなければ受信データリングバッファに残しておく
+        break;
+      }
+      gp = (gp + 1) & (RAW_BUFFER_SIZE - 1);
+      if (len == RAW_MARK_BOUNDARY)
+      {
+        close_params();
+        continue;
+      }
+#if DEBUG == 1
+      _bench_bytes += len;
+#endif
+      std::size_t first = std::min(len, RAW_BUFFER_SIZE - gp);
+      parse_data(&_raw_buffer[gp], first);
+      if (first < len)
+      {
+        parse_data(_raw_buffer, len - first);
+      }
+      gp = (gp + len) & (RAW_BUFFER_SIZE - 1);
+    } while (gp != sp);
+    _raw_buffer_getpos = gp;
 
-      // NVS領域やファームウェアへの書き込みはタスク通知を使うとクラッシュするのでfalseを返す
-      return _nvs_push ? false : true;
+    if (((sp - gp) & (RAW_BUFFER_SIZE - 1)) < RAW_RESUME_USED)
+    {
+      i2c_slave::resume_rx();
     }
-    return false;
+
+    // 受信した分のピクセルデータはすぐに処理側から見えるようにしておく
+    publish_stream();
+  }
+
+  /// ISR側でのコマンド長の判定 (コマンドByteを含む長さ。0は区切りまで続く不定長コマンドおよび未定義コマンド)
+  static inline __attribute__((always_inline)) std::size_t isr_command_length(std::uint8_t cmd)
+  {
+    std::uint_fast8_t len = _command_length.v[cmd];
+    return (len & CMDLEN_STREAM) ? 0 : len;
   }
 
-  void IRAM_ATTR prepareTxData(void)
+  /// ISR側の読出しコマンドの即時処理。応答は次のリード要求までに用意しておく必要がある
+  static void IRAM_ATTR isr_execute(std::uint8_t cmd)
+  {
+    switch (cmd)
+    {
+    default:
+      break;
+
+    case lgfx::Panel_M5UnitLCD::CMD_CASET:
+      _read_xs = std::max<std::uint_fast16_t>(_isr_params[0], 0);
+      _read_xe = std::min<std::uint_fast16_t>(_isr_params[1], _canvas.width()-1);
+      break;
+
+    case lgfx::Panel_M5UnitLCD::CMD_RASET:
+      _read_ys = std::max<std::uint_fast16_t>(_isr_params[0], 0);
+      _read_ye = std::min<std::uint_fast16_t>(_isr_params[1], _canvas.height()-1);
+      break;
+
+    case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_8:
+    case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_16:
+    case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_24:
+      start_readback(cmd);
+      prepareTxData();
+      break;
+
+    case lgfx::Panel_M5UnitLCD::CMD_READ_ID:
+    case lgfx::Panel_M5UnitLCD::CMD_READ_BUFCOUNT:
+    case CMD_READ_FLOWSTAT:
+    case CMD_READ_BUFSTAT:
+    case CMD_READ_FLUSHSTAT:
+    case CMD_READ_CLOCKSTAT:
+    case CMD_READ_HASH:
+    case CMD_READ_UPDATESTAT:
+      prepareTxData();
+      break;
+
+    case CMD_UPDATE_HASH:
+      /// 計算を終えるまでREAD_HASHにはBUSYを応答させる
+      _hash_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
+      break;
+    }
+  }
+
+  /// ISR側で受信データのコマンドの区切りを追跡し、読出し系のコマンドのみ即時処理する
+  static void IRAM_ATTR isr_track(const std::uint8_t* data, std::size_t len)
+  {
+    std::size_t i = 0;
+    while (i < len && _isr_remain != ISR_REMAIN_STREAM)
+    {
+      if (_isr_remain == 0)
+      {
+        std::uint8_t cmd = data[i++];
+        _last_command = cmd;
+        _isr_command = cmd;
+        _isr_param_index = 0;
+        /// メインタスクが READ_RAW の応答をFIFOへ書込まないよう、応答の切替えは _read_mux 取得中に行う
+        portENTER_CRITICAL_ISR(&_read_mux);
+        _read_active = false;
+        i2c_slave::clear_txdata();
+        portEXIT_CRITICAL_ISR(&_read_mux);
+        _isr_remain = isr_command_length(cmd);
+        if (cmd == lgfx::Panel_M5UnitLCD::CMD_UPDATE_END || cmd == CMD_UPDATE_END_SHA)
+        { /// 照合を終えるまでのリード要求に対してはBUSYを応答させる (成功時はそのまま再起動し、失敗時はERRORになる)
+          _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
+        }
+        if (_isr_remain == 0)
+        { // 不定長コマンドは区切りまで以降のデータを読み飛ばす
+          _isr_remain = ISR_REMAIN_STREAM;
+          i2c_slave::set_rx_burst(true);
+          if (cmd == lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA || cmd == CMD_UPDATE_DATA_SEQ || cmd == CMD_UPDATE_DATA_CONT)
+          { /// パース完了前のリード要求に対してはBUSYを応答させる
+            _firmupdate_result = lgfx::Panel_M5UnitLCD::UPDATE_RESULT_BUSY;
+            prepareTxData();
+          }
+          break;
+        }
+        --_isr_remain;
+      }
+      else
+      {
+        std::size_t l = std::min(_isr_remain, len - i);
+        _isr_remain -= l;
+        do
+        {
+          if (_isr_param_index < sizeof(_isr_params))
+          {
+            _isr_params[_isr_param_index] = data[i];
+          }
+          ++_isr_param_index;
+          ++i;
+        } while (--l);
+      }
+      if (_isr_remain == 0)
+      {
+        isr_execute(_isr_command);
+      }
+    }
+  }
+
+  /// 受信データリングバッファへの格納 (ISRから呼ばれる)
+  static void IRAM_ATTR push_raw(const std::uint8_t* data, std::size_t len)
+  {
+    std::size_t sp = _raw_buffer_setpos;
+    std::size_t free = (_raw_buffer_getpos - sp - 1) & (RAW_BUFFER_SIZE - 1);
+    if (data == nullptr)
+    { /// データの格納時に区切り1Byte分の空きを残しているため、空きがないのは直前に区切りを格納済みの場合のみ
+      _raw_overflow = false;
+      if (free == 0) { return; }
+      _raw_buffer[sp] = RAW_MARK_BOUNDARY;
+      _raw_buffer_setpos = (sp + 1) & (RAW_BUFFER_SIZE - 1);
+      return;
+    }
+    if (_raw_overflow || free < 1 + len + 1)
+    { // 空きがない場合は破棄し、パースが途中から再開しないよう区切りまで残りのデータも破棄する
+      _raw_overflow = true;
+      _raw_dropped += len;
+      return;
+    }
+    _raw_buffer[sp] = len;
+    for (std::size_t i = 0; i < len; ++i)
+    {
+      sp = (sp + 1) & (RAW_BUFFER_SIZE - 1);
+      _raw_buffer[sp] = data[i];
+    }
+    _raw_buffer_setpos = (sp + 1) & (RAW_BUFFER_SIZE - 1);
+  }
+
+  /// I2C STOP時などのデータの区切りの処理 (ISRから呼ばれる)
+  void IRAM_ATTR closeData(void)
+  {
+    _isr_remain = 0;
+    // 前回の区切り以降に受信データがなければ区切りを重ねて格納する必要はない
+    if (!_raw_closed)
+    {
+      _raw_closed = true;
+      push_raw(nullptr, 0);
+    }
+  }
+
+  /// フロー制御有効時、受信データリングバッファの空きが少なければfalseを返し、ISRに以降のトランザクションを断らせる
+  bool IRAM_ATTR acceptData(void)
+  {
+    /// 順番付きのブロックを受信している間は常に有効にし、書込みが追い付かない間は次のトランザクション(ブロックの続き)を断って送り直させる
+    /// (UPDATE_DATA_SEQ/CONTはNACKを受けて送り直す送信側のみが使う。従来のUPDATE_DATAはSET_FLOWCTRLで有効にした場合のみ)
+    bool update_block = _isr_remain == ISR_REMAIN_STREAM
+                     && (_isr_command == CMD_UPDATE_DATA_SEQ || _isr_command == CMD_UPDATE_DATA_CONT);
+    if (!_flowctrl && !update_block) { return true; }
+    std::size_t free = (_raw_buffer_getpos - _raw_buffer_setpos - 1) & (RAW_BUFFER_SIZE - 1);
+    return free >= RAW_REFUSE_FREE;
+  }
+
+  /// I2CペリフェラルISRからFIFOにまとめて届いたデータを受取る処理
+  bool IRAM_ATTR addData(const std::uint8_t* data, std::size_t len)
+  {
+    _received_bytes += len;
+    isr_track(data, len);
+    _raw_closed = false;
+    push_raw(data, len);
+
+    // NVS領域やファームウェアへの書き込みはタスク通知を使うとクラッシュするのでfalseを返す
+    return _nvs_push ? false : true;
+  }
+
+  /// I2CペリフェラルISRから1Byteずつデータを受取る処理
+  bool IRAM_ATTR addData(std::uint8_t value)
+  {
+    return addData(&value, 1);
+  }
+
+#if DEBUG == 1
+  /// 1秒ごとに受信データのパース量・コマンド処理数・転送ピクセル数を出力する
+  static void log_bench(void)
+  {
+    static std::uint32_t prev_ms, prev_bytes, prev_commands, prev_pixels, prev_batches;
+    std::uint32_t ms = lgfx::millis();
+    if (ms - prev_ms < 1000) { return; }
+    std::uint32_t pixels = _bench_pixels;
+    ESP_LOGI(LOGNAME, "bench(%s) parse:%u B/s cmd:%u/s flush:%u px/s"
+            , DUAL_CORE == 1 ? "dual" : "single"
+            , (_bench_bytes - prev_bytes) * 1000 / (ms - prev_ms)
+            , (_executed_records - prev_commands) * 1000 / (ms - prev_ms)
+            , (pixels - prev_pixels) * 1000 / (ms - prev_ms));
+    if (_batch_count != prev_batches)
+    {
+      auto& h = _bench_batch_hist;
+      ESP_LOGI(LOGNAME, "batch avg:%u max:%u hist 1:%u 2:%u 4:%u 8:%u 16:%u 32:%u 64:%u 128:%u"
+              , (_executed_records - prev_commands) / (_batch_count - prev_batches)
+              , _batch_max, h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+    }
+    prev_ms = ms;
+    prev_bytes = _bench_bytes;
+    prev_commands = _executed_records;
+    prev_pixels = pixels;
+    prev_batches = _batch_count;
+  }
+#endif
+
+#if DUAL_CORE == 1
+  /// コマンド1件分の描画範囲を転送段へ受渡す。キューに空きがない場合は次の機会まで保持する
+  static void IRAM_ATTR publish_dirty(void)
+  {
+    if (!_modified) { return; }
+    std::size_t sp = _flush_queue_setpos;
+    std::size_t next = (sp + 1) & (FLUSH_QUEUE_SIZE - 1);
+    if (next == _flush_queue_getpos) { return; }
+    _flush_queue[sp] = _pending_dirty;
+    _flush_queue_setpos = next;
+    _modified = false;
+    xTaskNotifyGive(_flush_task);
+  }
+
+  /// 転送段が処理すべき範囲を持っていないかどうか
+  static bool IRAM_ATTR flush_idle(void)
+  {
+    return _flush_idle && _flush_queue_getpos == _flush_queue_setpos;
+  }
+#endif
+
+  /// 転送方針に照らして、今パネルへ転送してよいかどうか
+  static bool IRAM_ATTR flush_allowed(void)
+  {
+    switch (_flush_mode)
+    {
+    default:
+      return true;
+
+    case flush_on_idle:
+      return _rx_buffer_getpos == _rx_buffer_setpos
+          && _raw_buffer_getpos == _raw_buffer_setpos;
+
+    case flush_on_commit:
+      return _commit_requested;
+
+    case flush_fixed_rate:
+      return esp_timer_get_time() - _last_flush_us >= _flush_interval_us;
+    }
+  }
+
+  /// 転送を見送った範囲を再評価するまでの待ち時間(tick)。0はすぐに転送すべき状態
+  static TickType_t IRAM_ATTR flush_wait_ticks(void)
+  {
+#if DUAL_CORE == 1
+    if (!_flush_held) { return portMAX_DELAY; }
+#else
+    if (!_modified) { return portMAX_DELAY; }
+#endif
+    if (flush_allowed()) { return 0; }
+    if (_flush_mode != flush_fixed_rate) { return portMAX_DELAY; }
+    std::int64_t remain = _flush_interval_us - (esp_timer_get_time() - _last_flush_us);
+    return 1 + remain / (1000 * portTICK_PERIOD_MS);
+  }
+
+  /// コマンド処理段 受信データのパースとキャンバスへの描画
+  static std::size_t IRAM_ATTR process_commands(void)
+  {
+    ulTaskNotifyTake( pdTRUE, 0 );
+    std::int64_t start = esp_timer_get_time();
+    /// READ_RAW の応答はリード要求に間に合うよう、受信データのパースより先に用意する
+    while (stage_readback()) {}
+    parse_rx();
+    while (stage_readback()) {}
+
+    /// 溜まっているコマンドは件数と時間の上限までまとめて処理し、パネルへの転送はバッチの区切りでのみ行う
+    std::size_t count = 0;
+    while (command())
+    {
+#if DUAL_CORE == 1
+      publish_dirty();
+#endif
+      if (++count >= _batch_max_commands || esp_timer_get_time() - start >= _batch_time_us) { break; }
+      if (_commit_requested) { break; } // COMMIT までの描画内容で転送させる
+    }
+#if DUAL_CORE == 1
+    publish_dirty();
+#endif
+    if (count)
+    {
+      ++_batch_count;
+      _batch_max = std::max<std::uint32_t>(_batch_max, count);
+#if DEBUG == 1
+      ++_bench_batch_hist[31 - __builtin_clz(count)];
+#endif
+    }
+#if DEBUG == 1
+    log_bench();
+#endif
+    governor::update( _received_bytes
+                    , esp_timer_get_time() - start
+                    , RX_BUFFER_SIZE - getBufferFree()
+                    , RX_BUFFER_SIZE);
+    return count;
+  }
+
+  /// コマンド処理段の唯一の待機点。I2C受信・DMA転送完了・フレーム間隔のタイマのいずれかで起床する
+  static void IRAM_ATTR wait_event(std::size_t count)
+  {
+    if (count || _firmupdate_state != firmupdate_state_t::nothing) { return; }
+
+    TickType_t wait = flush_wait_ticks();
+#if DUAL_CORE == 1
+    if (wait == 0)
+    { /// 転送段が見送っていた範囲が転送可能になった
+      xTaskNotifyGive(_flush_task);
+      wait = portMAX_DELAY;
+    }
+    if (_modified)
+    { /// キューが満杯で範囲を渡せていない。転送段がキューから受取った時点の通知まで待つ
+      _flush_queue_wait = true;
+      publish_dirty();  // 待つ指示を出す前に空いていた場合
+      if (!_modified)
+      {
+        _flush_queue_wait = false;
+        return;
+      }
+    }
+    /// 転送段のDMA転送中はAPBクロックを保つ80MHzまで、転送段も空けば下限まで下げる (転送段は完了時に通知する)
+    bool idle = !_modified && flush_idle();
+#else
+    bool dma = _spi_bus.busy();
+    /// 転送すべき内容があり、DMAも空いていればすぐに戻って転送する
+    if (!dma && (!wait || _flush_index < _flush_count)) { return; }
+    if (dma)
+    { /// DMA転送中はAPBクロックを保つ80MHzまでしか下げず、転送完了見込み時刻にタイマで起床する
+      arm_spi_timer();
+      wait = portMAX_DELAY;
+    }
+    bool idle = !dma;
+#endif
+#if DEBUG == 1
+    if (idle)
+    {
+      std::uint32_t clk_count, clk_us, clk_max_us, clk_boost;
+      cpu_clock::get_transition_stats(&clk_count, &clk_us, &clk_max_us, &clk_boost);
+      if (clk_count)
+      {
+        ESP_LOGI(LOGNAME, "clock switch:%u avg:%uus max:%uus isr boost:%u", clk_count, clk_us / clk_count, clk_max_us, clk_boost);
+      }
+    }
+#endif
+    governor::sleep(!idle);
+    ulTaskNotifyTake( pdTRUE, wait );
+    governor::wake();
+#if DUAL_CORE == 1
+    _flush_queue_wait = false;
+#endif
+  }
+
+
+#if DUAL_CORE == 1
+
+  /// 転送段 (Core1) コマンド処理段から受取った範囲を蓄積し、DMA転送が空き次第パネルへ出力する
+  void IRAM_ATTR loop(void)
+  {
+    bool idle = false;
+    _flush_busy = true;
+    if (!_flush_pause)
+    {
+      std::size_t gp = _flush_queue_getpos;
+      std::size_t sp = _flush_queue_setpos;
+      for (; gp != sp; gp = (gp + 1) & (FLUSH_QUEUE_SIZE - 1))
+      {
+        auto& r = _flush_queue[gp];
+        dirty_region::add(r.xs, r.ys, r.xe, r.ye);
+      }
+      if (_flush_queue_getpos != gp)
+      {
+        _flush_queue_getpos = gp;
+        if (_flush_queue_wait) { xTaskNotifyGive(_command_task); }
+      }
+
+      if (!_spi_bus.busy() && !flush_step())
+      {
+        if (dirty_region::empty()) { idle = true; }
+        else
+        if (!flush_allowed())
+        { /// 転送方針により見送る。再評価はコマンド処理段からの通知で行う (見送りの回数は保留に入った時のみ数える)
+          if (!_flush_held)
+          {
+            _flush_held = true;
+            ++_flush_skipped;
+          }
+          idle = true;
+        }
+        else { flush(); }
+      }
+    }
+    _flush_busy = false;
+
+    if (_flush_idle != idle)
+    {
+      _flush_idle = idle;
+      /// 転送完了をコマンド処理段へ通知し、クロックを下げる機会を与える
+      if (idle) { xTaskNotifyGive(_command_task); }
+    }
+    if (idle || _flush_pause)
+    {
+      ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+    }
+    else if (_spi_bus.busy())
+    { /// 次の一帯はDMA転送の完了見込み時刻まで待ってから送る
+      arm_spi_timer();
+      ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+    }
+  }
+
+#else
+
+  /// メインループ処理 蓄積したコマンドの処理およびLCDへの出力処理
+  void IRAM_ATTR loop(void)
+  {
+    std::size_t count = process_commands();
+    if (!_spi_bus.busy() && !flush_step() && _modified)
+    {
+      if (!flush_allowed())
+      { /// 見送りの回数は保留に入った時のみ数える
+        if (!_flush_held)
+        {
+          _flush_held = true;
+          ++_flush_skipped;
+        }
+      }
+      else
+      {
+#if DEBUG == 1
+auto bf = (int)getBufferFree();
+memset(_canvas.getBuffer(), 0xFF, bf);
+memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_SIZE - bf);
+dirty_region::add(0, 0, _lcd.width()-1, _lcd.height()-1);
+#endif
+        _modified = false;
+        flush();
+        //lcd.writePixels(static_cast<lgfx::swap565_t*>(sp.getBuffer()), sp.bufferLength()>>1);
+      }
+    }
+    wait_event(count);
+  }
+
+#endif
+
+  /// 32bit値の並びをビッグエンディアンで送信FIFOへ積む
+  static void IRAM_ATTR add_txdata_be32(const std::uint32_t* values, std::size_t count)
+  {
+    std::uint8_t buf[28];
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      buf[i * 4    ] = values[i] >> 24;
+      buf[i * 4 + 1] = values[i] >> 16;
+      buf[i * 4 + 2] = values[i] >>  8;
+      buf[i * 4 + 3] = values[i];
+    }
+    i2c_slave::add_txdata(buf, count * 4);
+  }
+
+  bool IRAM_ATTR prepareTxData(void)
   {
     static constexpr std::uint8_t dummy[] = { 0xff, 0xff };
     switch (_last_command)
@@ -916,9 +2351,96 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
       break;
 
     case lgfx::Panel_M5UnitLCD::CMD_UPDATE_DATA:
+    case lgfx::Panel_M5UnitLCD::CMD_UPDATE_END:
+    case CMD_UPDATE_END_SHA:
       i2c_slave::add_txdata(_firmupdate_result);
       break;
 
+    case CMD_READ_FLOWSTAT:
+      {
+        std::uint32_t stat[4];
+        stat[0] = _raw_dropped + _record_dropped;
+        i2c_slave::get_flow_stats(&stat[1], &stat[2], &stat[3]);
+        add_txdata_be32(stat, 4);
+      }
+      break;
+
+    case CMD_READ_CLOCKSTAT:
+      {
+        std::uint32_t stat[4];
+        if (_isr_params[0] < cpu_clock::clock_MAX)
+        {
+          cpu_clock::get_level_stats((cpu_clock::cpu_clock_t)_isr_params[0], &stat[0], &stat[1], &stat[2], &stat[3]);
+        }
+        else
+        { /// 全体の統計 : 切替回数・切替に要した時間(μs)・推定消費エネルギーの合計・I2C割込みによる引上げ回数
+          std::uint32_t max_us, ms, entries, energy, power;
+          cpu_clock::get_transition_stats(&stat[0], &stat[1], &max_us, &stat[3]);
+          stat[2] = 0;
+          for (std::size_t i = 0; i < cpu_clock::clock_MAX; ++i)
+          {
+            cpu_clock::get_level_stats((cpu_clock::cpu_clock_t)i, &ms, &entries, &energy, &power);
+            stat[2] += energy;
+          }
+        }
+        add_txdata_be32(stat, 4);
+      }
+      break;
+
+    case CMD_READ_UPDATESTAT:
+      { /// [0]直近のブロックの結果 [1]ブロックサイズ(2を底) [2-3]次に受付けるブロックの順番 [4]応答を待たずに送信してよいブロック数 [5]書込み待ちの数 [6-7]破棄したブロックの数
+        std::size_t shift = 0;
+        while (((std::size_t)1 << shift) < update::getBlockSize()) { ++shift; }
+        std::size_t seq = update::getNextSequence();
+        std::size_t broken = update::getBrokenCount();
+        std::uint8_t buf[8] =
+        { (std::uint8_t)_firmupdate_result
+        , (std::uint8_t)shift
+        , (std::uint8_t)(seq >> 8), (std::uint8_t)seq
+        , (std::uint8_t)update::getWindow(UPDATE_BUFFERED)
+        , (std::uint8_t)update::getPendingWrites()
+        , (std::uint8_t)(broken >> 8), (std::uint8_t)broken
+        };
+        i2c_slave::add_txdata(buf, sizeof(buf));
+      }
+      break;
+
+    case CMD_READ_HASH:
+      i2c_slave::add_txdata(_hash_result);
+      if (_hash_result == lgfx::Panel_M5UnitLCD::UPDATE_RESULT_OK)
+      {
+        add_txdata_be32(_hash_values, _hash_count);
+      }
+      break;
+
+    case CMD_READ_FLUSHSTAT:
+      {
+        std::uint32_t stat[2] = { _flush_issued, _flush_skipped };
+        add_txdata_be32(stat, 2);
+        /// ダブルバッファは確保に失敗すると無効のままになるため、設定値ではなく実際の状態を返す
+        std::uint8_t buf[2] = { (std::uint8_t)(_front_buffer != nullptr), _color_depth };
+        i2c_slave::add_txdata(buf, sizeof(buf));
+      }
+      break;
+
+    case CMD_READ_BUFSTAT:
+      {
+        /// パース前の受信データもコマンドバッファを消費するものとして空き容量から差引く
+        std::size_t raw_used = (_raw_buffer_setpos - _raw_buffer_getpos) & (RAW_BUFFER_SIZE - 1);
+        std::size_t cmd_free = getBufferFree();
+        std::uint32_t stat[7];
+        std::uint32_t isr_bytes;
+        stat[0] = cmd_free > raw_used ? cmd_free - raw_used : 0;
+        stat[1] = _executed_records;
+        stat[2] = _received_bytes;
+        stat[3] = _pushed_records - stat[1];
+        stat[4] = _batch_count;
+        stat[5] = _batch_max;
+        i2c_slave::get_isr_stats(&stat[6], &isr_bytes);
+        add_txdata_be32(stat, 7);
+      }
+      break;
+
     case lgfx::Panel_M5UnitLCD::CMD_READ_BUFCOUNT:
       {
         std::uint32_t res = 255;
@@ -928,16 +2450,14 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
         }
         else
         {
-          std::int32_t sp = _rx_buffer_setpos;
-          std::int32_t gp = _rx_buffer_getpos;
-          if (sp != gp)
+          std::size_t raw_used = (_raw_buffer_setpos - _raw_buffer_getpos) & (RAW_BUFFER_SIZE - 1);
+          if (_rx_buffer_setpos != _rx_buffer_getpos || raw_used)
           {
-            //std::int32_t buf_free = ((int)(getBufferFree() + 512) - rxbuffer_max) >> 1;
-            std::int32_t buf_free = gp - sp;
-            if (buf_free > 0) buf_free -= RX_BUFFER_MAX;
-            // 
-            buf_free = (buf_free + 512) >> 1;
-            res = std::max(1, std::min(254, buf_free));
+            /// 空き容量をコマンドバッファ全体に対する比率で 1~254 の範囲に収めて返す
+            /// (パース前の受信データもコマンドバッファを消費するものとして差引く)
+            std::size_t cmd_free = getBufferFree();
+            std::int32_t buf_free = (cmd_free > raw_used ? cmd_free - raw_used : 0) >> RX_BUFCOUNT_SHIFT;
+            res = std::max<std::int32_t>(1, std::min<std::int32_t>(254, buf_free));
           }
         }
         i2c_slave::add_txdata((std::uint8_t*)&res, 1);
@@ -947,36 +2467,16 @@ memset((std::uint8_t*)_canvas.getBuffer() + bf, 0, RX_BUFFER_MAX - bf + 1);
     case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_8:
     case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_16:
     case lgfx::Panel_M5UnitLCD::CMD_READ_RAW_24:
-      for (std::size_t i = 0; i < 8; ++i)
-      {
-        std::uint32_t res = _canvas.readPixelValue(_read_xptr, _read_yptr);
-        std::size_t bytes = _last_command & 3;
-        switch (bytes)
-        {
-          case 2: res = lgfx::color_convert<lgfx::swap565_t, lgfx::bgr888_t>(res); break;
-          case 1: res = lgfx::color_convert<lgfx::rgb332_t, lgfx::bgr888_t>(res); break;
-          default: break;
-        }
-        if (_byteswap)
-        {
-          switch (bytes)
-          {
-            case 3: res = lgfx::getSwap24(res); break;
-            case 2: res = lgfx::getSwap16(res); break;
-            default: break;
-          }
-        }
-        i2c_slave::add_txdata((std::uint8_t*)&res, bytes);
-        if (++_read_xptr > _read_xe)
-        {
-          _read_xptr = _read_xs;
-          if (++_read_yptr > _read_ye)
-          {
-            _read_yptr = _read_ys;
-          }
-        }
+      { /// 送信待ちバッファからFIFOの空き分を複写するのみとし、ピクセルの変換はメインタスクで行う
+        portENTER_CRITICAL_ISR(&_read_mux);
+        std::size_t remain = feed_txfifo();
+        portEXIT_CRITICAL_ISR(&_read_mux);
+
+        /// 残りが半分を下回ったらメインタスクに補充させる
+        return _read_active && !_nvs_push && remain < TX_STAGE_SIZE / 2;
       }
       break;
     }
+    return false;
   }
 }
@@ -4,9 +4,12 @@
 #pragma once
 
 // #define DEBUG 1
+// #define DUAL_CORE 1   // Core0でパースと描画、Core1でパネルへの転送を行う
+// #define RX_BYTEWISE 1 // 不定長コマンドもRX FIFOの閾値を上げずに受信する (バースト受信とのISR負荷の比較用)
 #pragma GCC optimize ("O3")
 
 #include <cstdint>
+#include <cstddef>
 
 namespace command_processor
 {
@@ -14,6 +17,8 @@ namespace command_processor
   void loop(void);
 
   bool addData(std::uint8_t value);
+  bool addData(const std::uint8_t* data, std::size_t len);
   void closeData(void);
-  void prepareTxData(void);
+  bool acceptData(void);
+  bool prepareTxData(void);
 }
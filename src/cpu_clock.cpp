@@ -3,32 +3,85 @@
 
 #include <driver/rtc_io.h>
 #include <soc/rtc.h>
+#include <esp_timer.h>
+#if __has_include(<esp_private/esp_timer_private.h>)
+ #include <esp_private/esp_timer_private.h>
+#else
+ #error "esp_private/esp_timer_private.h is required to keep esp_timer in step with APB clock changes"
+#endif
 #include <algorithm>
 
 #include "cpu_clock.hpp"
+#include "i2c_slave.hpp"
 
 #include <M5GFX.h>
 
 namespace cpu_clock
 {
+  /// 各クロックでのAPBクロック(MHz)。80MHz未満ではCPUと同じ周波数になる
+  static constexpr std::uint8_t _apb_mhz[clock_MAX] = { 8, 10, 20, 40, 80, 80, 80 };
+
   rtc_cpu_freq_config_t _cpu_freq_conf[clock_MAX];
   cpu_clock_t _clock_min    = clock_80MHz;
   cpu_clock_t _clock_max    = clock_160MHz;
   cpu_clock_t _now_clock     = clock_MAX;  
   cpu_clock_t _request_clock = clock_240MHz;
+  cpu_clock_t _boost_clock   = clock_80MHz;
 
-  void IRAM_ATTR set_cpu_clock(cpu_clock_t clock)
+  // クロック切替はタスクとI2C割込みの双方から行うため排他する
+  portMUX_TYPE _clock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+  // クロック切替に要した時間の統計
+  std::uint32_t _transition_count = 0;
+  std::uint32_t _transition_us = 0;
+  std::uint32_t _transition_max_us = 0;
+  std::uint32_t _boost_count = 0;
+
+  // 各クロックの滞在時間と切替回数
+  std::uint64_t _residency_us[clock_MAX] = { 0 };
+  std::uint32_t _entry_count[clock_MAX] = { 0 };
+  std::int64_t _last_change_us = 0;
+
+  // 各クロックでの消費電力(mW)。既定値はESP32の動作電流からの概算で、実機に合わせて set_power_table で変更する
+  std::uint16_t _power_mw[clock_MAX] = { 20, 22, 28, 40, 70, 100, 130 };
+
+  /// _clock_mux を確保した状態で呼ぶこと
+  static void IRAM_ATTR change_clock(cpu_clock_t clock)
   {
     if (_now_clock != clock)
     {
    if (_now_clock < clock) lgfx::gpio_hi(0);
    else lgfx::gpio_lo(0);
   //ESP_LOGI("UnitLCD","set_clock:%d", clock);
+      std::int64_t start = esp_timer_get_time();
+      if (_now_clock < clock_MAX)
+      {
+        _residency_us[_now_clock] += start - _last_change_us;
+      }
+      _last_change_us = start;
+      ++_entry_count[clock];
+      bool apb_changed = (_now_clock == clock_MAX) || (_apb_mhz[_now_clock] != _apb_mhz[clock]);
       _now_clock = clock;
       rtc_clk_cpu_freq_set_config_fast(&_cpu_freq_conf[clock]);
+      if (apb_changed)
+      { /// APBクロックで動作するタイマとI2Cのタイミング設定を新しい周波数に合わせる
+        esp_timer_impl_update_apb_freq(_apb_mhz[clock]);
+        i2c_slave::set_apb_clock(_apb_mhz[clock]);
+      }
+      std::uint32_t us = esp_timer_get_time() - start;
+      ++_transition_count;
+      _transition_us += us;
+      if (_transition_max_us < us) { _transition_max_us = us; }
     }
   }
 
+  void IRAM_ATTR set_cpu_clock(cpu_clock_t clock)
+  {
+    portENTER_CRITICAL_SAFE(&_clock_mux);
+    change_clock(clock);
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
+  }
+
   void init(void)
   {
     rtc_clk_cpu_freq_mhz_to_config(240, &_cpu_freq_conf[cpu_clock_t::clock_240MHz]);
@@ -42,28 +95,84 @@ namespace cpu_clock
 
   void IRAM_ATTR request_clock_up(cpu_clock_t clock)
   {
+    portENTER_CRITICAL_SAFE(&_clock_mux);
     clock = std::min(clock, _clock_max);
     if (_request_clock < clock)
     {
       _request_clock = clock;
-      set_cpu_clock(clock);
+      change_clock(clock);
     }
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
   }
 
   void IRAM_ATTR request_clock_down(cpu_clock_t clock)
   {
+    portENTER_CRITICAL_SAFE(&_clock_mux);
     clock = std::max(clock, _clock_min);
     if (_request_clock > clock)
     {
       _request_clock = clock;
-      set_cpu_clock(clock);
+      change_clock(clock);
     }
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
   }
 
   void IRAM_ATTR set_clock_limit(cpu_clock_t clock_min, cpu_clock_t clock_max)
   {
+    portENTER_CRITICAL_SAFE(&_clock_mux);
     _clock_min = clock_min;
     _clock_max = clock_max;
-    set_cpu_clock(std::min(clock_max, std::max(clock_min, _request_clock)));
+    change_clock(std::min(clock_max, std::max(clock_min, _request_clock)));
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
+  }
+
+  void IRAM_ATTR set_boost_clock(cpu_clock_t clock)
+  {
+    _boost_clock = clock;
+  }
+
+  /// I2C割込みから呼ぶ。待機中の低いクロックのままで受信データを処理しないよう、タスクの起床を待たずに引上げる
+  void IRAM_ATTR boost(void)
+  {
+    if (_request_clock >= _boost_clock) { return; }
+    portENTER_CRITICAL_SAFE(&_clock_mux);
+    cpu_clock_t clock = std::min(_boost_clock, _clock_max);
+    if (_request_clock < clock)
+    {
+      _request_clock = clock;
+      change_clock(clock);
+      ++_boost_count;
+    }
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
+  }
+
+  cpu_clock_t IRAM_ATTR get_clock(void)
+  {
+    return _now_clock;
+  }
+
+  void IRAM_ATTR set_power_table(cpu_clock_t clock, std::uint16_t power_mw)
+  {
+    if (clock < clock_MAX) { _power_mw[clock] = power_mw; }
+  }
+
+  void IRAM_ATTR get_level_stats(cpu_clock_t clock, std::uint32_t* residency_ms, std::uint32_t* entries, std::uint32_t* energy_mj, std::uint32_t* power_mw)
+  {
+    portENTER_CRITICAL_SAFE(&_clock_mux);
+    std::uint64_t us = _residency_us[clock];
+    if (clock == _now_clock) { us += esp_timer_get_time() - _last_change_us; }
+    *entries = _entry_count[clock];
+    portEXIT_CRITICAL_SAFE(&_clock_mux);
+    *power_mw = _power_mw[clock];
+    *residency_ms = us / 1000;
+    *energy_mj = us * _power_mw[clock] / 1000000;
+  }
+
+  void IRAM_ATTR get_transition_stats(std::uint32_t* count, std::uint32_t* total_us, std::uint32_t* max_us, std::uint32_t* boost_count)
+  {
+    *count = _transition_count;
+    *total_us = _transition_us;
+    *max_us = _transition_max_us;
+    *boost_count = _boost_count;
   }
 }
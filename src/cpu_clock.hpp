@@ -1,6 +1,10 @@
 //! Copyright (c) M5Stack. All rights reserved.
 //! Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
+#pragma once
+
+#include <cstdint>
+
 namespace cpu_clock
 {
   enum cpu_clock_t
@@ -19,4 +23,15 @@ namespace cpu_clock
   void set_clock_limit(cpu_clock_t clock_min, cpu_clock_t clock_max);
   void request_clock_up(cpu_clock_t clock);
   void request_clock_down(cpu_clock_t clock);
+
+  /// I2C割込みからの引上げ先のクロックを設定する
+  void set_boost_clock(cpu_clock_t clock);
+  /// 現在のクロックが引上げ先より低ければ引上げる (割込みから呼べる)
+  void boost(void);
+  cpu_clock_t get_clock(void);
+  /// クロック毎の消費電力(mW)を設定する。消費エネルギーの推定に使う
+  void set_power_table(cpu_clock_t clock, std::uint16_t power_mw);
+  /// 指定クロックでの滞在時間・切替回数・推定消費エネルギー・消費電力の設定値を取得する
+  void get_level_stats(cpu_clock_t clock, std::uint32_t* residency_ms, std::uint32_t* entries, std::uint32_t* energy_mj, std::uint32_t* power_mw);
+  void get_transition_stats(std::uint32_t* count, std::uint32_t* total_us, std::uint32_t* max_us, std::uint32_t* boost_count);
 }
@@ -0,0 +1,67 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/// ファームウェア更新のブロック検査用CRC32 (多項式0x04C11DB7 MSBファースト 初期値0xFFFFFFFF 最終XORなし)
+/// テーブルはコンパイル時に生成し、4Byte単位で計算する (slice-by-4)
+/// ※ examples/FirmwareUpdater/crc32.hpp は本ファイルと同じ内容を保つこと
+namespace crc
+{
+  namespace detail
+  {
+    static constexpr std::uint32_t POLY = 0x04C11DB7;
+
+    constexpr std::uint32_t step(std::uint32_t c, int n)
+    {
+      return n ? step((c << 1) ^ ((c & 0x80000000u) ? POLY : 0), n - 1) : c;
+    }
+
+    /// k段目のテーブル値 : 0段目は1Byte分、k段目は0段目の値に更にkByte分の0を流した値
+    constexpr std::uint32_t entry(std::size_t k, std::uint32_t i)
+    {
+      return k ? ((entry(k - 1, i) << 8) ^ step(entry(k - 1, i) & 0xFF000000u, 8))
+               : step(i << 24, 8);
+    }
+
+    template <std::size_t...> struct seq {};
+    template <std::size_t N, std::size_t... I> struct make_seq : make_seq<N - 1, N - 1, I...> {};
+    template <std::size_t... I> struct make_seq<0, I...> { typedef seq<I...> type; };
+
+    struct table_t
+    {
+      std::uint32_t t[4][256];
+    };
+
+    template <std::size_t... I>
+    constexpr table_t make_table(seq<I...>)
+    {
+      return table_t { { { entry(0, I)... }, { entry(1, I)... }, { entry(2, I)... }, { entry(3, I)... } } };
+    }
+
+    static constexpr table_t table = make_table(make_seq<256>::type());
+  }
+
+  static constexpr std::uint32_t CRC32_INIT = 0xFFFFFFFF;
+
+  /// crc に前回の戻り値を渡すと続きのデータとして計算する
+  static inline std::uint32_t calc32(std::uint32_t crc, const std::uint8_t* data, std::size_t len)
+  {
+    auto& t = detail::table.t;
+    while (len >= 4)
+    {
+      crc ^= (std::uint32_t)data[0] << 24 | (std::uint32_t)data[1] << 16 | (std::uint32_t)data[2] << 8 | data[3];
+      crc = t[3][crc >> 24] ^ t[2][(crc >> 16) & 0xFF] ^ t[1][(crc >> 8) & 0xFF] ^ t[0][crc & 0xFF];
+      data += 4;
+      len -= 4;
+    }
+    while (len--)
+    {
+      crc = (crc << 8) ^ t[0][(crc >> 24) ^ *data++];
+    }
+    return crc;
+  }
+}
@@ -0,0 +1,91 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <esp_attr.h>
+#include <algorithm>
+
+#include "dirty_region.hpp"
+
+namespace dirty_region
+{
+  /// 範囲を分けて転送する場合の1範囲あたりの手間 (範囲設定とDMA転送の開始) をピクセル数に換算した値
+  static constexpr std::int32_t MERGE_SLACK_PIXELS = 64;
+
+  rect_t _rects[MAX_RECTS];
+  std::size_t _count = 0;
+
+  static std::int32_t area(const rect_t& r)
+  {
+    return (r.xe - r.xs + 1) * (r.ye - r.ys + 1);
+  }
+
+  static rect_t merge(const rect_t& a, const rect_t& b)
+  {
+    return { std::min(a.xs, b.xs), std::min(a.ys, b.ys), std::max(a.xe, b.xe), std::max(a.ye, b.ye) };
+  }
+
+  /// 結合すると外接矩形の余分な範囲も転送するため、増える転送量が範囲を分ける手間を超えない場合のみ結合する
+  /// (矩形の枠線の各辺や、角で接する縦横の線は結合せずに別々に転送する)
+  static bool worth_merging(const rect_t& a, const rect_t& b)
+  {
+    return area(merge(a, b)) <= area(a) + area(b) + MERGE_SLACK_PIXELS;
+  }
+
+  void IRAM_ATTR add(std::int_fast16_t xs, std::int_fast16_t ys, std::int_fast16_t xe, std::int_fast16_t ye)
+  {
+    rect_t r = { xs, ys, xe, ye };
+
+    /// 結合しても転送量がほぼ増えない矩形と結合し、結合結果が別の矩形と結合できるようになれば更に繰り返す
+    std::size_t i = 0;
+    while (i < _count)
+    {
+      if (worth_merging(_rects[i], r))
+      {
+        r = merge(_rects[i], r);
+        _rects[i] = _rects[--_count];
+        i = 0;
+      }
+      else
+      {
+        ++i;
+      }
+    }
+    if (_count < MAX_RECTS)
+    {
+      _rects[_count++] = r;
+      return;
+    }
+
+    /// リストが一杯の場合は、結合による面積の増加が最も小さい矩形と結合する
+    std::size_t best = 0;
+    std::int32_t best_cost = INT32_MAX;
+    for (i = 0; i < _count; ++i)
+    {
+      std::int32_t cost = area(merge(_rects[i], r)) - area(_rects[i]);
+      if (best_cost > cost)
+      {
+        best_cost = cost;
+        best = i;
+      }
+    }
+    _rects[best] = merge(_rects[best], r);
+  }
+
+  std::size_t IRAM_ATTR take(rect_t* rects)
+  {
+    std::size_t count = _count;
+    std::copy(_rects, _rects + count, rects);
+    _count = 0;
+    return count;
+  }
+
+  void IRAM_ATTR clear(void)
+  {
+    _count = 0;
+  }
+
+  bool IRAM_ATTR empty(void)
+  {
+    return _count == 0;
+  }
+}
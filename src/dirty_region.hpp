@@ -0,0 +1,26 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace dirty_region
+{
+  static constexpr std::size_t MAX_RECTS = 8;
+
+  /// パネル座標系での更新範囲 (xe,yeを含む)
+  struct rect_t
+  {
+    std::int_fast16_t xs;
+    std::int_fast16_t ys;
+    std::int_fast16_t xe;
+    std::int_fast16_t ye;
+  };
+
+  void add(std::int_fast16_t xs, std::int_fast16_t ys, std::int_fast16_t xe, std::int_fast16_t ye);
+  std::size_t take(rect_t* rects);
+  void clear(void);
+  bool empty(void);
+}
@@ -0,0 +1,171 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#include "governor.hpp"
+
+namespace governor
+{
+  using namespace cpu_clock;
+
+  struct profile_conf_t
+  {
+    cpu_clock_t clock_min;
+    cpu_clock_t clock_max;
+  };
+
+  static constexpr profile_conf_t _profiles[profile_MAX] =
+  { { clock_10MHz , clock_40MHz  }
+  , { clock_80MHz , clock_160MHz }
+  , { clock_240MHz, clock_240MHz }
+  };
+
+  static constexpr std::uint32_t _clock_mhz[clock_MAX] = { 8, 10, 20, 40, 80, 160, 240 };
+
+  static constexpr std::int64_t WINDOW_US = 10000;         // 負荷を評価する区間の長さ
+  static constexpr std::uint32_t LOAD_TARGET_PERCENT = 70; // 区間内の処理時間がこの割合に収まるクロックを選ぶ
+  static constexpr std::uint32_t DOWN_HOLD_COUNT = 4;      // 下げる判断がこの区間数続いたら1段下げる
+  static constexpr std::size_t QUEUE_BOOST_SHIFT = 4;      // 処理待ちが容量の1/16を超えたら1段上げる
+  static constexpr std::size_t QUEUE_MAX_SHIFT = 2;        // 処理待ちが容量の1/4を超えたら上限まで上げる
+
+  profile_conf_t _conf = _profiles[profile_normal];
+  cpu_clock_t _level = clock_80MHz;   // 負荷から選んだクロック
+  cpu_clock_t _hint = clock_8MHz;     // 評価区間内に受けた最大のヒント
+  std::int64_t _window_start = 0;
+  std::uint32_t _window_busy_us = 0;
+  std::uint32_t _window_received = 0;
+  std::uint32_t _last_received = 0;
+  std::uint32_t _cycles_per_byte = 0; // 受信1Byteあたりの処理サイクル数 (平滑化済み)
+  std::uint32_t _down_count = 0;
+  bool _dma_hold = false;             // DMA転送中のため80MHz未満に下げない (次のsleepで更新する)
+
+  static cpu_clock_t IRAM_ATTR clamp(cpu_clock_t clock)
+  {
+    return std::min(_conf.clock_max, std::max(_conf.clock_min, clock));
+  }
+
+  /// I2C割込みによる引上げも含め、現在の要求値より高ければ上げ、低ければ下げる (一方のみが作用する)
+  /// DMA転送中はSPIのクロック源であるAPBクロックが変わらない80MHz以上に留める (設定の上限より優先する)
+  static void IRAM_ATTR apply(cpu_clock_t clock)
+  {
+    clock = clamp(clock);
+    if (_dma_hold) { clock = std::max(clock, clock_80MHz); }
+    request_clock_up(clock);
+    request_clock_down(clock);
+  }
+
+  /// 待機中に受信が始まった場合は、直近の負荷に見合うクロックへ割込みから引上げさせる (APBクロックを既定に戻すため80MHz以上)
+  static void IRAM_ATTR update_boost(void)
+  {
+    set_boost_clock(clamp(std::max(_level, clock_80MHz)));
+  }
+
+  /// 指定の周波数(MHz)以上で最も低いクロック
+  static cpu_clock_t IRAM_ATTR clock_for_mhz(std::uint32_t mhz)
+  {
+    std::size_t i = 0;
+    while (i < clock_MAX - 1 && _clock_mhz[i] < mhz) { ++i; }
+    return (cpu_clock_t)i;
+  }
+
+  void init(void)
+  {
+    _window_start = esp_timer_get_time();
+    set_profile(profile_normal);
+  }
+
+  void IRAM_ATTR set_profile(profile_t profile)
+  {
+    if (profile >= profile_MAX) { return; }
+    _conf = _profiles[profile];
+    /// cpu_clock側の上限は、DMA転送中に80MHzへ引上げられるよう80MHz未満にしない
+    set_clock_limit(_conf.clock_min, std::max(_conf.clock_max, clock_80MHz));
+    _level = clamp(_level);
+    update_boost();
+    apply(_level);
+  }
+
+  void IRAM_ATTR hint(cpu_clock_t clock)
+  {
+    if (_hint < clock) { _hint = clock; }
+    if (get_clock() < clamp(clock)) { apply(clock); }
+  }
+
+  void IRAM_ATTR update(std::uint32_t received, std::uint32_t busy_us, std::size_t queued, std::size_t capacity)
+  {
+    cpu_clock_t clock = get_clock();
+    std::uint32_t mhz = _clock_mhz[clock < clock_MAX ? clock : _level];
+    _window_busy_us += busy_us;
+    _window_received += received - _last_received;
+    _last_received = received;
+
+    /// 処理待ちが溜まっている場合は区間の終わりを待たずに引上げる
+    if (queued > (capacity >> QUEUE_MAX_SHIFT))
+    {
+      _level = _conf.clock_max;
+      _down_count = 0;
+      update_boost();
+      apply(_level);
+      return;
+    }
+
+    std::int64_t now = esp_timer_get_time();
+    std::int64_t elapsed = now - _window_start;
+    if (elapsed < WINDOW_US) { return; }
+
+    /// 区間内の処理に要したサイクル数から受信1Byteあたりのコストを求め、到着速度に見合うクロックを予測する
+    std::uint32_t cycles = _window_busy_us * mhz;
+    if (_window_received)
+    {
+      std::uint32_t cpb = cycles / _window_received;
+      _cycles_per_byte = _cycles_per_byte ? (_cycles_per_byte * 3 + cpb) >> 2 : cpb;
+    }
+    std::uint32_t need_cycles = std::max<std::uint32_t>(cycles, _window_received * _cycles_per_byte);
+    std::uint32_t target_mhz = (std::int64_t)need_cycles * 100 / (LOAD_TARGET_PERCENT * elapsed);
+    cpu_clock_t target = clock_for_mhz(target_mhz);
+
+    if (queued > (capacity >> QUEUE_BOOST_SHIFT) && target <= _level && _level < clock_MAX - 1)
+    {
+      target = (cpu_clock_t)(_level + 1);
+    }
+    target = std::max(target, _hint);
+    target = clamp(target);
+
+    /// 上げる判断は即座に反映し、下げる判断は続いた場合にのみ1段ずつ反映する
+    if (target > _level)
+    {
+      _level = target;
+      _down_count = 0;
+    }
+    else if (target < _level && ++_down_count >= DOWN_HOLD_COUNT)
+    {
+      _level = (cpu_clock_t)(_level - 1);
+      _down_count = 0;
+    }
+    else if (target == _level)
+    {
+      _down_count = 0;
+    }
+
+    _window_start = now;
+    _window_busy_us = 0;
+    _window_received = 0;
+    _hint = clock_8MHz;
+    update_boost();
+    apply(_level);
+  }
+
+  void IRAM_ATTR sleep(bool dma)
+  {
+    _dma_hold = dma;
+    apply(_conf.clock_min);
+  }
+
+  void IRAM_ATTR wake(void)
+  {
+    apply(std::max(_level, _hint));
+  }
+}
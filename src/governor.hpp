@@ -0,0 +1,36 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "cpu_clock.hpp"
+
+/// コマンドの処理負荷から動作クロックを選択する (cpu_clockの上位層)
+namespace governor
+{
+  /// SET_POWER の設定値に対応する動作方針
+  enum profile_t
+  { profile_low     // 低速 : 10MHz ~ 40MHz
+  , profile_normal  // 通常 : 80MHz ~ 160MHz
+  , profile_high    // 高速 : 240MHz固定
+  , profile_MAX
+  };
+
+  void init(void);
+  void set_profile(profile_t profile);
+
+  /// 処理するコマンドが必要とするクロックを伝える。現在より高ければ即座に引上げる
+  void hint(cpu_clock::cpu_clock_t clock);
+
+  /// コマンド処理の区切り毎に呼ぶ。received:受信Byte数の累計 busy_us:処理に要した時間 queued:処理待ちのByte数 capacity:バッファの容量
+  void update(std::uint32_t received, std::uint32_t busy_us, std::size_t queued, std::size_t capacity);
+
+  /// 待機に入る前に呼ぶ。dma:DMA転送中(APBクロックを保つ必要がある)
+  void sleep(bool dma);
+
+  /// 待機から復帰した直後に呼ぶ
+  void wake(void);
+}
@@ -10,8 +10,12 @@
 #include <soc/rtc.h>
 #include <freertos/FreeRTOS.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <xtensa/hal.h>
+#include <algorithm>
 
 #include "command_processor.hpp"
+#include "cpu_clock.hpp"
 #include "i2c_slave.hpp"
 
 namespace i2c_slave
@@ -19,10 +23,14 @@ namespace i2c_slave
   static constexpr std::size_t soc_i2c_fifo_len = 32;
   static constexpr std::uint32_t i2c_intr_mask = 0x3fff;  /*!< I2C all interrupt bitmap */
   static constexpr std::uint32_t I2C_FIFO_FULL_THRESH_VAL      = 1;
+  static constexpr std::uint32_t I2C_FIFO_FULL_THRESH_BURST    = 24;      /* 不定長コマンド受信中のRX FIFO閾値 (残り8Byte分をISR応答の猶予とする) */
   static constexpr std::uint32_t I2C_FIFO_EMPTY_THRESH_VAL     = 2;
   static constexpr std::uint32_t I2C_SLAVE_TIMEOUT_DEFAULT     = 0xFFFFF; /* I2C slave timeout value, APB clock cycle number */
+  static constexpr std::uint32_t I2C_SLAVE_TIMEOUT_IDLE_US     = 100;     /* 不定長コマンド受信中、SCLがこの時間(μs)変化しなければFIFOの残りを受取る */
   static constexpr std::uint32_t I2C_SLAVE_SDA_SAMPLE_DEFAULT  = 4;       /* I2C slave sample time after scl positive edge default value */
   static constexpr std::uint32_t I2C_SLAVE_SDA_HOLD_DEFAULT    = 4;       /* I2C slave hold time after scl negative edge default value */
+  static constexpr std::uint32_t I2C_APB_MHZ_DEFAULT           = 80;      /* 上記のAPBクロック数を定めたAPBクロック周波数 */
+  static constexpr std::uint8_t  I2C_REFUSE_ADDR               = 0x7F;    /* 受信を断る間に設定するアドレス (予約アドレスのためマスタから呼ばれることはない) */
 
   struct i2c_obj_t
   {
@@ -30,10 +38,118 @@ namespace i2c_slave
     i2c_port_t i2c_num;   // I2C port number
     xTaskHandle main_handle = nullptr;
     std::uint32_t addr;   // I2C slave addr
+    bool rx_burst = false;  // 不定長コマンドの受信中 (RX FIFOの閾値を上げ、受信の途切れをタイムアウト割込みで検出する)
+    std::uint32_t apb_mhz = I2C_APB_MHZ_DEFAULT;
+    bool started = false;
   };
 
   i2c_obj_t i2c_obj;
 
+  // 割込み許可レジスタはISRとメインタスクの双方から書換えるため排他する
+  portMUX_TYPE _int_ena_mux = portMUX_INITIALIZER_UNLOCKED;
+  // 受信を断る状態はISR(開始)とメインタスク(解除)の双方から書換えるため排他する
+  portMUX_TYPE _refuse_mux = portMUX_INITIALIZER_UNLOCKED;
+
+  // 受信を断った状態(フロー制御)とFIFOオーバーフローの統計
+  volatile bool _rx_refused = false;
+  std::int64_t _rx_refuse_start = 0;
+  std::uint32_t _rx_refuse_count = 0;
+  std::uint32_t _rx_refuse_us = 0;
+  std::uint32_t _rx_fifo_overflow = 0;
+
+  // ISRの処理に要したCPUサイクル数とISRで受取ったByte数の累計 (READ_BUFSTATで読出し、ISR負荷の計測に使う)
+  std::uint32_t _isr_cycles = 0;
+  std::uint32_t _isr_bytes = 0;
+
+  void get_isr_stats(std::uint32_t* cycles, std::uint32_t* bytes)
+  {
+    *cycles = _isr_cycles;
+    *bytes = _isr_bytes;
+  }
+
+  /// タイムアウトの設定値 (APBクロック数)。不定長コマンドの受信中は受信の途切れを検出する短い値にする
+  static std::uint32_t IRAM_ATTR timeout_cycles(std::uint32_t apb_mhz)
+  {
+    return i2c_obj.rx_burst ? I2C_SLAVE_TIMEOUT_IDLE_US * apb_mhz
+                            : I2C_SLAVE_TIMEOUT_DEFAULT / I2C_APB_MHZ_DEFAULT * apb_mhz;
+  }
+
+  static void IRAM_ATTR set_burst(i2c_dev_t* dev, bool enable)
+  {
+    if (i2c_obj.rx_burst == enable) { return; }
+    i2c_obj.rx_burst = enable;
+    dev->fifo_conf.rx_fifo_full_thrhd = enable ? I2C_FIFO_FULL_THRESH_BURST : I2C_FIFO_FULL_THRESH_VAL;
+    dev->timeout.tout = timeout_cycles(i2c_obj.apb_mhz);
+    portENTER_CRITICAL_SAFE(&_int_ena_mux);
+    dev->int_ena.time_out = enable;
+    portEXIT_CRITICAL_SAFE(&_int_ena_mux);
+  }
+
+  /// 不定長コマンドの受信中はRX FIFOの閾値を上げ、FIFOに溜まったデータをまとめて受取る。
+  /// 閾値に満たないまま送信が途切れた分は、SCLの変化が止まった時点のタイムアウト割込みで受取る
+  /// (トランザクション区切りで自動的に1Byte単位に戻る)
+  void IRAM_ATTR set_rx_burst(bool enable)
+  {
+#if RX_BYTEWISE == 1
+    if (enable) { return; }
+#endif
+    set_burst(i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1, enable);
+  }
+
+  /// 次のトランザクションからアドレスにNACKを返し、送信側に間隔を空けて送り直させる。
+  /// ESP32のI2CスレーブはSCLを保持して送信側を待たせることができないため、受付け済みのトランザクションは最後まで受取る
+  static void IRAM_ATTR refuse_rx(i2c_dev_t* dev)
+  {
+    portENTER_CRITICAL_ISR(&_refuse_mux);
+    if (!_rx_refused)
+    {
+      _rx_refused = true;
+      _rx_refuse_start = esp_timer_get_time();
+      ++_rx_refuse_count;
+      dev->slave_addr.addr = I2C_REFUSE_ADDR;
+    }
+    portEXIT_CRITICAL_ISR(&_refuse_mux);
+  }
+
+  /// refuse_rx で断っていた受信を再開し、本来のアドレスで応答させる
+  void IRAM_ATTR resume_rx(void)
+  {
+    if (!_rx_refused) { return; }
+    auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
+    portENTER_CRITICAL(&_refuse_mux);
+    if (_rx_refused)
+    {
+      _rx_refused = false;
+      _rx_refuse_us += esp_timer_get_time() - _rx_refuse_start;
+      dev->slave_addr.addr = i2c_obj.addr;
+    }
+    portEXIT_CRITICAL(&_refuse_mux);
+  }
+
+  void IRAM_ATTR get_flow_stats(std::uint32_t* fifo_overflow, std::uint32_t* refuse_count, std::uint32_t* refuse_us)
+  {
+    *fifo_overflow = _rx_fifo_overflow;
+    *refuse_count = _rx_refuse_count;
+    std::uint32_t us = _rx_refuse_us;
+    if (_rx_refused) { us += esp_timer_get_time() - _rx_refuse_start; }
+    *refuse_us = us;
+  }
+
+  /// APBクロック数で指定するタイミング設定を、実時間が既定値(APB 80MHz時)と同じになるよう換算して設定する
+  static void IRAM_ATTR apply_timing(i2c_dev_t* dev, std::uint32_t apb_mhz)
+  {
+    dev->sda_hold.time = std::max<std::uint32_t>(1, I2C_SLAVE_SDA_HOLD_DEFAULT * apb_mhz / I2C_APB_MHZ_DEFAULT);
+    dev->sda_sample.time = std::max<std::uint32_t>(1, I2C_SLAVE_SDA_SAMPLE_DEFAULT * apb_mhz / I2C_APB_MHZ_DEFAULT);
+    dev->timeout.tout = timeout_cycles(apb_mhz);
+  }
+
+  void IRAM_ATTR set_apb_clock(std::uint32_t apb_mhz)
+  {
+    i2c_obj.apb_mhz = apb_mhz;
+    if (!i2c_obj.started) { return; }
+    apply_timing(i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1, apb_mhz);
+  }
+
   bool IRAM_ATTR is_busy(void)
   {
     auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
@@ -45,45 +161,82 @@ namespace i2c_slave
     auto p_i2c = (i2c_obj_t*)arg;
     auto dev = p_i2c->i2c_num == 0 ? &I2C0 : &I2C1;
 
+    std::uint32_t ccount = xthal_get_ccount();
     std::uint32_t rx_fifo_cnt = dev->status_reg.rx_fifo_cnt;
     typeof(dev->int_status) int_sts;
     int_sts.val = dev->int_status.val;
+    if (int_sts.trans_start)
+    { /// 待機中の低いクロックのままで受信データを処理しないよう、ここでクロックを引上げる
+      cpu_clock::boost();
+    }
+    bool boundary = int_sts.trans_complete || int_sts.trans_start || int_sts.arbitration_lost;
+    if (int_sts.rx_fifo_ovf)
+    {
+      ++_rx_fifo_overflow;
+    }
     if (rx_fifo_cnt)
     {
-      bool notify = false;
+      /// FIFOの内容を一括で取出してからまとめて受信データリングバッファに渡す
+      std::uint8_t rxbuf[soc_i2c_fifo_len];
+      std::size_t len = 0;
       do
       {
-        if (command_processor::addData(dev->fifo_data.data))
-        {
-          notify = true;
-        }  
-      } while (--rx_fifo_cnt);
-      if (notify)
+        rxbuf[len] = dev->fifo_data.data;
+      } while (++len < rx_fifo_cnt);
+
+      if (command_processor::addData(rxbuf, len))
       {
         BaseType_t xHigherPriorityTaskWoken = pdFALSE;
         vTaskNotifyGiveFromISR(p_i2c->main_handle, &xHigherPriorityTaskWoken);
         portYIELD_FROM_ISR();
       }
+      _isr_bytes += len;
+      /// 受信側の空きが少なければ、FIFOは読出したうえで以降のトランザクションを断る
+      if (!command_processor::acceptData())
+      {
+        refuse_rx(dev);
+      }
     }
-    if (int_sts.tx_fifo_empty)
-    {
-      command_processor::prepareTxData();
+    if (int_sts.tx_fifo_empty && command_processor::prepareTxData())
+    { /// 送信待ちデータの補充をメインタスクに依頼する
+      BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+      vTaskNotifyGiveFromISR(p_i2c->main_handle, &xHigherPriorityTaskWoken);
+      portYIELD_FROM_ISR();
     }
-    if (int_sts.trans_complete || int_sts.trans_start || int_sts.arbitration_lost)
+    if (boundary)
     {
       command_processor::closeData();
+      set_burst(dev, false);
     }
     dev->int_clr.val = int_sts.val;
+    _isr_cycles += xthal_get_ccount() - ccount;
   }
 
   void IRAM_ATTR clear_txdata(void)
   {
     auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
+    portENTER_CRITICAL_ISR(&_int_ena_mux);
     dev->int_ena.tx_fifo_empty = false;
+    portEXIT_CRITICAL_ISR(&_int_ena_mux);
     dev->fifo_conf.tx_fifo_rst = 1;
     dev->fifo_conf.tx_fifo_rst = 0;
   }
 
+  /// 補充する送信データがない間、TX FIFOの空き割込みを止める (FIFOの残りはそのまま送らせる。次の add_txdata で再開する)
+  void IRAM_ATTR stop_txdata(void)
+  {
+    auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
+    portENTER_CRITICAL_ISR(&_int_ena_mux);
+    dev->int_ena.tx_fifo_empty = false;
+    portEXIT_CRITICAL_ISR(&_int_ena_mux);
+  }
+
+  std::size_t IRAM_ATTR get_txfifo_free(void)
+  {
+    auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
+    return soc_i2c_fifo_len - dev->status_reg.tx_fifo_cnt;
+  }
+
   void IRAM_ATTR add_txdata(const std::uint8_t* buf, std::size_t len)
   {
     uint32_t fifo_addr = (i2c_obj.i2c_num == 0) ? 0x6001301c : 0x6002701c;
@@ -93,7 +246,9 @@ namespace i2c_slave
     }
     auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
     dev->int_clr.tx_fifo_empty = true;
+    portENTER_CRITICAL_ISR(&_int_ena_mux);
     dev->int_ena.tx_fifo_empty = true;
+    portEXIT_CRITICAL_ISR(&_int_ena_mux);
   }
 
   void IRAM_ATTR add_txdata(std::uint8_t buf)
@@ -102,13 +257,16 @@ namespace i2c_slave
     WRITE_PERI_REG(fifo_addr, buf);
     auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
     dev->int_clr.tx_fifo_empty = true;
+    portENTER_CRITICAL_ISR(&_int_ena_mux);
     dev->int_ena.tx_fifo_empty = true;
+    portEXIT_CRITICAL_ISR(&_int_ena_mux);
   }
 
   void IRAM_ATTR start_isr(void)
   {
     auto dev = i2c_obj.i2c_num == 0 ? &I2C0 : &I2C1;
     dev->int_ena.val = I2C_RXFIFO_FULL_INT_ENA
+                     | I2C_RXFIFO_OVF_INT_ENA
                      | I2C_TRANS_COMPLETE_INT_ENA
                      | I2C_ARBITRATION_LOST_INT_ENA
                      | I2C_TXFIFO_EMPTY_INT_ENA
@@ -148,15 +306,16 @@ namespace i2c_slave
     typeof(dev->fifo_conf) fifo_conf;
     fifo_conf.val = 0;
     fifo_conf.rx_fifo_full_thrhd = I2C_FIFO_FULL_THRESH_VAL;
+    i2c_obj.rx_burst = false;
     fifo_conf.tx_fifo_empty_thrhd = I2C_FIFO_EMPTY_THRESH_VAL;
     dev->fifo_conf.val = fifo_conf.val;
 
+    _rx_refused = false;
     dev->slave_addr.addr = i2c_obj.addr;
     dev->slave_addr.en_10bit = 0;
 
-    dev->sda_hold.time = I2C_SLAVE_SDA_HOLD_DEFAULT;
-    dev->sda_sample.time = I2C_SLAVE_SDA_SAMPLE_DEFAULT;
-    dev->timeout.tout = I2C_SLAVE_TIMEOUT_DEFAULT;
+    apply_timing(dev, i2c_obj.apb_mhz);
+    i2c_obj.started = true;
 
     dev->scl_filter_cfg.en = 1;
     dev->scl_filter_cfg.thres = 0;
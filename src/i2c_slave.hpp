@@ -21,4 +21,11 @@ namespace i2c_slave
   void add_txdata(const std::uint8_t* buf, std::size_t len);
   void add_txdata(std::uint8_t buf);
   void clear_txdata(void);
+  void stop_txdata(void);
+  std::size_t get_txfifo_free(void);
+  void set_rx_burst(bool enable);
+  void set_apb_clock(std::uint32_t apb_mhz);
+  void resume_rx(void);
+  void get_flow_stats(std::uint32_t* fifo_overflow, std::uint32_t* refuse_count, std::uint32_t* refuse_us);
+  void get_isr_stats(std::uint32_t* cycles, std::uint32_t* bytes);
 }
@@ -0,0 +1,192 @@
+//! Copyright (c) M5Stack. All rights reserved.
+//! Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/// 圧縮形式(UPDATE_BEGIN_EX)・差分形式(UPDATE_BEGIN_DELTA)の受信データの展開処理。
+/// 出力先は TSink に任せ、ESP-IDFに依存しないためホスト上でも同じ処理を検証できる
+/// (examples/FirmwareUpdater/delta_firmware.py の selftest で生成したデータを展開させている)
+///
+/// TSink は次の静的関数を持つこと。いずれも失敗時はfalseを返す
+///   bool put(std::uint8_t value)                        展開した1Byteを出力する
+///   bool copy(std::size_t src, std::size_t len)         元イメージの src から len Byteを出力する (範囲は確認済み)
+///   bool check_base(std::size_t size, std::uint32_t crc32)  元イメージのサイズとCRC32が一致するか確認する
+namespace image_decoder
+{
+  /// どちらの形式も末尾4Byteは展開後のイメージ全体のCRC32
+  static constexpr std::size_t TRAILER_SIZE = 4;
+
+  /// LZSS : 制御Byte1つで8トークン、下位ビットから 1:リテラル1Byte 0:参照2Byte
+  /// 参照は [0]=距離-1の下位8bit [1]上位4bit=距離-1の上位4bit 下位4bit=長さ-3 (距離1~4096 長さ3~18)
+  static constexpr std::size_t LZ_WINDOW_SIZE = 4096;
+
+  /// 差分 : 先頭8Byteは元イメージのサイズとCRC32、以降は次の命令の並び (ビッグエンディアン)
+  ///   0x00~0x7F : 挿入 続く(値+1)Byteをそのまま出力する
+  ///   0x80~0xFF : 複写 [0]下位7bit,[1-2]=長さ-1 [3-5]=元イメージ内の位置
+  static constexpr std::size_t DELTA_BASE_HEADER = 8;
+  static constexpr std::size_t DELTA_COPY_HEADER = 6;
+
+  enum format_t
+  { format_lz
+  , format_delta
+  };
+
+  template <typename TSink>
+  class decoder_t
+  {
+  public:
+    /// totalsize:受信データ全体のサイズ(末尾のCRC32を含む) image_size:展開後のサイズ window:LZSSの参照窓 (LZ_WINDOW_SIZE Byte)
+    void reset(format_t format, std::size_t totalsize, std::size_t image_size, std::uint8_t* window)
+    {
+      _format = format;
+      _totalsize = totalsize;
+      _image_size = image_size;
+      _window = window;
+      _outsize = 0;
+      _zindex = 0;
+      _trailer_crc = 0;
+      _error = (totalsize <= TRAILER_SIZE) || (format == format_lz && window == nullptr);
+      _base_error = false;
+      _lz_flags = 0;
+      _lz_has_low = false;
+      _delta_head_len = 0;
+      _delta_literal = 0;
+      _base_ok = false;
+      _base_size = 0;
+    }
+
+    /// 受信データの続きを展開する。展開できないデータを受取った場合はfalseを返し、以降は何もしない
+    bool input(const std::uint8_t* data, std::size_t len)
+    {
+      std::size_t payload_end = _totalsize - TRAILER_SIZE;
+      for (std::size_t i = 0; i < len && !_error; ++i, ++_zindex)
+      {
+        if (_zindex >= _totalsize) { _error = true; }
+        else if (_zindex >= payload_end) { _trailer_crc = _trailer_crc << 8 | data[i]; }
+        else if (_format == format_lz) { lz_input(data[i]); }
+        else { delta_input(data[i]); }
+      }
+      return !_error;
+    }
+
+    /// 末尾のCRC32まで受取ったかどうか
+    bool finished(void) const { return _zindex == _totalsize; }
+    bool error(void) const { return _error; }
+    /// 差分の元イメージが一致しなかった
+    bool base_error(void) const { return _base_error; }
+    std::size_t outsize(void) const { return _outsize; }
+    std::uint32_t trailer_crc(void) const { return _trailer_crc; }
+
+  private:
+    format_t _format = format_lz;
+    std::size_t _totalsize = 0;
+    std::size_t _image_size = 0;
+    std::size_t _outsize = 0;           // 展開済みのByte数
+    std::size_t _zindex = 0;            // 展開済みの受信データのByte数
+    std::uint32_t _trailer_crc = 0;     // 受信データ末尾のCRC32
+    bool _error = false;
+    bool _base_error = false;
+
+    std::uint8_t* _window = nullptr;    // 展開済みデータの参照窓
+    std::uint_fast16_t _lz_flags = 0;   // 制御Byte (上位の番兵ビットが残りのトークン数を表す)
+    std::uint8_t _lz_low = 0;
+    bool _lz_has_low = false;
+
+    std::uint8_t _delta_head[DELTA_BASE_HEADER];
+    std::size_t _delta_head_len = 0;
+    std::size_t _delta_literal = 0;     // 挿入の残りByte数
+    std::size_t _base_size = 0;
+    bool _base_ok = false;
+
+    static std::uint32_t be32(const std::uint8_t* p)
+    {
+      return (std::uint32_t)p[0] << 24 | (std::uint32_t)p[1] << 16 | (std::uint32_t)p[2] << 8 | p[3];
+    }
+
+    void put(std::uint8_t value)
+    {
+      if (_outsize >= _image_size || !TSink::put(value)) { _error = true; return; }
+      ++_outsize;
+    }
+
+    void lz_put(std::uint8_t value)
+    {
+      _window[_outsize & (LZ_WINDOW_SIZE - 1)] = value;
+      put(value);
+    }
+
+    void lz_input(std::uint8_t value)
+    {
+      if (_lz_flags <= 1)
+      { /// 制御Byte
+        _lz_flags = value | 0x100;
+        return;
+      }
+      if (_lz_flags & 1)
+      { /// リテラル
+        _lz_flags >>= 1;
+        lz_put(value);
+        return;
+      }
+      if (!_lz_has_low)
+      {
+        _lz_low = value;
+        _lz_has_low = true;
+        return;
+      }
+      /// 参照 : 展開済みデータの距離dist前から len Byteを複写する (重なりがあっても1Byteずつ複写するため正しく展開される)
+      _lz_has_low = false;
+      _lz_flags >>= 1;
+      std::size_t dist = (_lz_low | (value >> 4) << 8) + 1;
+      std::size_t len = (value & 0x0F) + 3;
+      if (dist > _outsize) { _error = true; return; }
+      do
+      {
+        lz_put(_window[(_outsize - dist) & (LZ_WINDOW_SIZE - 1)]);
+      } while (--len && !_error);
+    }
+
+    void delta_input(std::uint8_t value)
+    {
+      if (_delta_literal)
+      {
+        --_delta_literal;
+        put(value);
+        return;
+      }
+      _delta_head[_delta_head_len++] = value;
+      if (!_base_ok)
+      { /// 最初の命令より前に、元イメージがパッチ作成時のものと一致するか確認する
+        if (_delta_head_len < DELTA_BASE_HEADER) { return; }
+        _delta_head_len = 0;
+        _base_size = be32(&_delta_head[0]);
+        _base_ok = TSink::check_base(_base_size, be32(&_delta_head[4]));
+        if (!_base_ok)
+        {
+          _base_error = true;
+          _error = true;
+        }
+        return;
+      }
+      if (_delta_head[0] < 0x80)
+      {
+        _delta_head_len = 0;
+        _delta_literal = _delta_head[0] + 1;
+        return;
+      }
+      if (_delta_head_len < DELTA_COPY_HEADER) { return; }
+      _delta_head_len = 0;
+      std::size_t src = (std::size_t)_delta_head[3] << 16 | _delta_head[4] << 8 | _delta_head[5];
+      std::size_t len = ((std::size_t)(_delta_head[0] & 0x7F) << 16 | _delta_head[1] << 8 | _delta_head[2]) + 1;
+      if (src + len > _base_size || _outsize + len > _image_size || !TSink::copy(src, len))
+      {
+        _error = true;
+        return;
+      }
+      _outsize += len;
+    }
+  };
+}
@@ -1,48 +1,49 @@
 
 #include "update.hpp"
 #include "common.hpp"
+#include "crc32.hpp"
+#include "image_decoder.hpp"
 
 //#include <Update.h>
 #include <esp_partition.h>
 #include <esp_ota_ops.h>
 #include <esp_log.h>
 #include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <mbedtls/sha256.h>
 #include <cstring>
+#include <algorithm>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 namespace update
 {
   static constexpr std::size_t SKIP_SIZE = 16;
   std::uint8_t _header_buffer[SKIP_SIZE];
-  std::uint8_t _buffer[SPI_FLASH_SEC_SIZE];
-  std::size_t _bufindex = 0;
-  std::size_t _totalindex = 0;
+  std::size_t _bufindex = 0;      // 受信中のブロック内の位置
+  std::size_t _block_offset = 0;  // 受信中のブロックの先頭の位置
+  std::size_t _block_size = SPI_FLASH_SEC_SIZE;
+  std::size_t _secindex = 0;      // 無圧縮時の受信中のセクタバッファ内の位置
   std::size_t _totalsize = 0;
   std::uint32_t _crc32 = 0;
+  bool _discard = false;          // 順番の合わないブロックを読み捨てている
+  std::size_t _discard_offset = 0;  // 読み捨てているブロックの先頭の位置
+  std::uint16_t _broken_count = 0;
 
-  std::uint32_t _crc_table[256];
   std::uint32_t _calc_crc32;
 
-  void initCRCtable(void)
-  {
-    std::size_t i = 0;
-    do
-    {
-      std::uint32_t c = i << 24;
-      std::size_t j = 0;
-      do
-      {
-          c = ( c << 1) ^ ( ( c & 0x80000000) ? 0x04C11DB7 : 0);
-      } while ( ++j < 8 );
-      _crc_table[i] = c;
-    } while ( ++i < 256 );
-  }
+  /// 受信用と書込み用を交互に使い、書込み中に次のセクタを受信できるようにする
+  static constexpr std::size_t BUFFER_COUNT = 2;
+  std::uint8_t _buffers[BUFFER_COUNT][SPI_FLASH_SEC_SIZE];
+  std::uint8_t* _buffer = _buffers[0];  // 受信中のバッファ
+  std::size_t _buffer_select = 0;
 
   struct write_info_t
   {
     enum status_t
     { none
+    , pending
     , ok
     , error
     };
@@ -54,13 +55,137 @@ namespace update
     volatile status_t status = status_t::none;
   };
 
+  /// 書込み要求のキュー (バッファと同数)
+  write_info_t _jobs[BUFFER_COUNT];
+  std::size_t _job_setpos = 0;
+  std::size_t _job_getpos = 0;
+  volatile bool _write_error = false;
+
+  /// 書込み先の範囲を先頭から順に消去しておく位置
+  volatile std::size_t _erase_pos = 0;
+  volatile std::size_t _erase_end = 0;
+
+  TaskHandle_t _writer_task = nullptr;
+  bool _started = false;          // begin/resume が成功している
+  volatile bool _writer_busy = false;
+  /// 書込みタスクが処理を1つ終える毎に与える。待つ側はタスク通知を使わないため、I2C受信の通知を取りこぼさない
+  SemaphoreHandle_t _writer_event = nullptr;
+
   const esp_partition_t* _partition;
 
-  bool IRAM_ATTR begin(std::size_t totalsize)
+  format_t _format = format_raw;
+
+  /// 圧縮形式・差分形式の展開状態。受信データの解釈は image_decoder が行い、ここでは出力先のセクタバッファを管理する
+  std::uint8_t* _zbuffer = nullptr;   // 受信した圧縮/差分ブロック (初回に確保する)
+  std::size_t _zbuffer_size = 0;
+  std::size_t _image_size = 0;        // 展開後のイメージのサイズ
+  std::size_t _flushed = 0;           // 書込みへ回した展開済みのByte数
+  std::size_t _outindex = 0;          // 展開中のセクタバッファ内の位置
+  std::uint32_t _image_crc = 0;       // 展開したデータのCRC32
+  bool _decode_error = false;
+  bool _image_ok = false;
+  std::uint8_t* _window = nullptr;    // LZSSの参照窓 (圧縮形式の初回に確保する)
+  const esp_partition_t* _base_partition = nullptr;  // 差分の元イメージ (実行中のパーティション)
+
+  /// 展開したデータの出力先。セクタバッファへ詰め、埋まったセクタから書込みへ回す
+  struct image_sink_t
   {
+    static bool put(std::uint8_t value);
+    static bool copy(std::size_t src, std::size_t len);
+    static bool check_base(std::size_t size, std::uint32_t crc32);
+  };
+  image_decoder::decoder_t<image_sink_t> _decoder;
+
+  /// 書込んだイメージ全体のSHA-256。書込みタスクが内容の確定した範囲をメモリマップで読み戻し、書込みの合間に計算を進める
+  /// (ハードウェアのSHAエンジンはコンテキストを使うタスクが保持するため、コンテキストの操作はすべて書込みタスクで行う)
+  static constexpr std::size_t SHA256_SIZE = 32;
+  mbedtls_sha256_context _sha;
+  std::uint8_t _sha_digest[SHA256_SIZE];
+  volatile std::size_t _sha_pos = 0;    // 計算済みの位置
+  volatile std::size_t _sha_limit = 0;  // 内容が確定し、計算してよい位置
+  volatile bool _sha_restart = false;   // 先頭から計算し直す
+  volatile bool _sha_done = false;
+  volatile bool _sha_error = false;
+  bool _sha_active = false;
+
+  static void writerTask(void*);
+  static bool wait_jobs(void);
+
+  /// 書込みタスクの処理が進むまで待つ。条件を満たすまで繰返し呼ぶ
+  static void wait_writer(void)
+  {
+    xSemaphoreTake(_writer_event, portMAX_DELAY);
+  }
+  static bool queue_sector(std::size_t offset, std::size_t len);
+
+  static bool alloc_zbuffer(std::size_t size)
+  {
+    if (_zbuffer_size >= size) { return true; }
+    if (_zbuffer) { heap_caps_free(_zbuffer); }
+    _zbuffer = (std::uint8_t*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    _zbuffer_size = _zbuffer ? size : 0;
+    return _zbuffer != nullptr;
+  }
+
+  /// 積まれた書込みを終えさせ、先行消去を止めてから消去位置を offset へ移す (以降の書込みでは offset から消去し直す)
+  /// ハッシュの計算も止め、offset 以降を計算済みであれば先頭から計算し直させる
+  static void rewind_erase(std::size_t offset)
+  {
+    wait_jobs();
+    std::size_t erase_end = _erase_end;
+    std::size_t sha_limit = _sha_limit;
+    _erase_end = 0;
+    _sha_limit = 0;
+    while (_writer_busy) { wait_writer(); }
+    _erase_pos = offset;
+    if (offset < _sha_pos)
+    { /// 計算を終えていた場合も、先頭から計算し直した結果を待たせる
+      _sha_pos = 0;
+      _sha_restart = true;
+      _sha_done = false;
+      _sha_error = false;
+    }
+    _sha_limit = std::min(sha_limit, offset);
+    _erase_end = erase_end;
+    xTaskNotifyGive(_writer_task);
+  }
+
+  /// 内容が確定した位置までハッシュの計算を進めさせる
+  static void advance_sha(std::size_t pos)
+  {
+    _sha_limit = std::min(pos, _image_size);
+    xTaskNotifyGive(_writer_task);
+  }
+
+  /// keep:書込み先の内容を残す (先行消去を行わず、書込む直前にそのセクタのみを消去する)
+  static bool start(std::size_t totalsize, format_t format, std::size_t image_size, bool keep)
+  {
+    /// 前回の書込み要求と先行消去・ハッシュの計算が止まるのを待つ
+    _started = false;
+    if (_writer_event == nullptr) { _writer_event = xSemaphoreCreateBinary(); }
+    _erase_end = 0;
+    _sha_limit = 0;
+    wait_jobs();
+    while (_writer_busy) { wait_writer(); }
+
     _totalsize = totalsize;
-    _totalindex = 0;
+    _block_offset = 0;
+    _block_size = SPI_FLASH_SEC_SIZE;
     _bufindex = 0;
+    _secindex = 0;
+    _discard = false;
+    _broken_count = 0;
+    _format = format;
+    _image_size = (format == format_raw) ? totalsize : image_size;
+    _flushed = 0;
+    _outindex = 0;
+    _image_crc = crc::CRC32_INIT;
+    _decode_error = false;
+    _image_ok = false;
+    _sha_pos = 0;
+    _sha_restart = true;
+    _sha_done = false;
+    _sha_error = false;
 
     _partition = esp_ota_get_next_update_partition(nullptr);
     if (_partition == nullptr)
@@ -69,68 +194,351 @@ namespace update
       return false;
     }
     ESP_EARLY_LOGI(LOGNAME, "OTA Partition: %s", _partition->label);
+
+    if (format != format_raw)
+    {
+      alloc_zbuffer(SPI_FLASH_SEC_SIZE);
+      if (format == format_lz && _window == nullptr) { _window = (std::uint8_t*)heap_caps_malloc(image_decoder::LZ_WINDOW_SIZE, MALLOC_CAP_8BIT); }
+      _base_partition = (format == format_delta) ? esp_ota_get_running_partition() : nullptr;
+      if (_zbuffer == nullptr
+       || (format == format_lz && _window == nullptr)
+       || (format == format_delta && _base_partition == nullptr)
+       || totalsize <= image_decoder::TRAILER_SIZE || image_size > _partition->size)
+      {
+        ESP_EARLY_LOGE(LOGNAME, "OTA encoded image not acceptable");
+        _decode_error = true;
+        return false;
+      }
+      _decoder.reset( format == format_lz ? image_decoder::format_lz : image_decoder::format_delta
+                    , totalsize, image_size, _window);
+    }
+
+    /// 書込み先の範囲の消去を裏で始めさせる
+    _buffer_select = 0;
+    _buffer = _buffers[0];
+    _write_error = false;
+    _erase_pos = 0;
+    _erase_end = keep ? 0 : std::min<std::size_t>(_partition->size, (_image_size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1));
+    if (_writer_task == nullptr)
+    { /// Core1で書き込みを行うとクラッシュする事があるためCore0で書き込みを行う
+      xTaskCreatePinnedToCore(writerTask, "writerTask", 4096, nullptr, 2, &_writer_task, 0);
+    }
+    xTaskNotifyGive(_writer_task);
+    _started = true;
     return true;
   }
 
-  void IRAM_ATTR setBlockCRC32(std::uint32_t crc32)
+  bool IRAM_ATTR begin(std::size_t totalsize, format_t format, std::size_t image_size)
   {
-    _calc_crc32 = 0xffffffff;
-    _crc32 = crc32;
+    return start(totalsize, format, image_size, false);
+  }
+
+  bool resume(std::size_t totalsize)
+  {
+    return start(totalsize, format_raw, 0, true);
+  }
+
+  bool seek(std::size_t offset)
+  {
+    if (_format != format_raw || (offset & (SPI_FLASH_SEC_SIZE - 1)) || offset >= _totalsize) { return false; }
+
+    rewind_erase(offset);
+    _block_offset = offset;
     _bufindex = 0;
+    _secindex = 0;
+    _discard = false;
+    return true;
   }
 
-  bool IRAM_ATTR addData(std::uint8_t data)
+  std::size_t setBlockSize(std::size_t size)
   {
-    if (_bufindex >= SPI_FLASH_SEC_SIZE)
+    /// ブロックの受信を始める前のみ変更できる。圧縮/差分形式はブロック全体を受信してから展開するため、確保できなければ4KBのままとする
+    if (_block_offset == 0 && _bufindex == 0
+     && (size == SPI_FLASH_SEC_SIZE || size == SPI_FLASH_SEC_SIZE * 4 || size == SPI_FLASH_SEC_SIZE * 16)
+     && (_format == format_raw || alloc_zbuffer(size)))
     {
-      return false;
+      _block_size = size;
     }
-    _calc_crc32 = (_calc_crc32 << 8) ^ _crc_table[((_calc_crc32 >> 24) ^ data) & 0xff];
-    _buffer[_bufindex++] = data;
-    ++_totalindex;
-    return (_bufindex < SPI_FLASH_SEC_SIZE && _totalindex < _totalsize);
+    return _block_size;
   }
 
-  bool IRAM_ATTR checkCRC32(void)
+  std::size_t IRAM_ATTR getBlockSize(void)
   {
-    return _crc32 == _calc_crc32;
+    return _block_size;
   }
 
-  static void writeTask(void* args)
+  std::size_t IRAM_ATTR getWindow(std::size_t buffered)
   {
-    auto info = (write_info_t*)args;
-    if ((!info->finish && (ESP_OK != esp_partition_erase_range(_partition, info->offset, SPI_FLASH_SEC_SIZE)))
-     || (ESP_OK != esp_partition_write(_partition, info->offset, info->buffer, info->len))
-     || (info->finish && (ESP_OK != esp_ota_set_boot_partition(_partition))))
+    /// 無圧縮はセクタバッファ、圧縮/差分形式はブロック全体を受信するバッファで溜められる分を加える
+    std::size_t capacity = buffered + (_format == format_raw ? BUFFER_COUNT * SPI_FLASH_SEC_SIZE : _block_size);
+    return std::max<std::size_t>(1, capacity / _block_size);
+  }
+
+  std::size_t IRAM_ATTR getNextSequence(void)
+  {
+    return (_block_offset + _block_size - 1) / _block_size;
+  }
+
+  std::size_t IRAM_ATTR getPosition(void)
+  {
+    return _block_offset;
+  }
+
+  std::size_t IRAM_ATTR getPendingWrites(void)
+  {
+    return (_job_setpos - _job_getpos + BUFFER_COUNT) % BUFFER_COUNT;
+  }
+
+  std::size_t IRAM_ATTR getBrokenCount(void)
+  {
+    return _broken_count;
+  }
+
+  bool hashSectors(std::size_t sector, std::size_t count, std::uint32_t* result)
+  {
+    auto partition = esp_ota_get_next_update_partition(nullptr);
+    if (partition == nullptr
+     || (sector + count) * SPI_FLASH_SEC_SIZE > partition->size) { return false; }
+
+    /// 受信中のセクタバッファを壊さないよう、小さな単位で読出して計算する
+    std::uint8_t buf[256];
+    for (std::size_t i = 0; i < count; ++i)
     {
-      info->status = write_info_t::status_t::error;
+      std::uint32_t crc = crc::CRC32_INIT;
+      std::size_t offset = (sector + i) * SPI_FLASH_SEC_SIZE;
+      for (std::size_t pos = 0; pos < SPI_FLASH_SEC_SIZE; pos += sizeof(buf))
+      {
+        if (ESP_OK != esp_partition_read(partition, offset + pos, buf, sizeof(buf))) { return false; }
+        crc = crc::calc32(crc, buf, sizeof(buf));
+      }
+      result[i] = crc;
     }
-    else
+    return true;
+  }
+
+  /// 受信途中のブロックを破棄する。無圧縮で先に書込みへ回したセクタがあれば、送り直された時に消去し直させる
+  static void drop_block(void)
+  {
+    if (_format == format_raw && !_discard && _bufindex > _secindex)
+    {
+      rewind_erase(_block_offset);
+    }
+    _bufindex = 0;
+    _secindex = 0;
+    _discard = false;
+  }
+
+  void setBlockCRC32(std::uint32_t crc32)
+  {
+    if (_bufindex) { drop_block(); }
+    _calc_crc32 = crc::CRC32_INIT;
+    _crc32 = crc32;
+    _discard = false;
+  }
+
+  bool setBlock(std::size_t sequence, std::uint32_t crc32)
+  {
+    setBlockCRC32(crc32);
+    /// 読み捨てるブロックの長さは受信済みの位置ではなく、送られてきたブロック自身の位置から求める
+    _discard_offset = sequence * _block_size;
+    _discard = (_discard_offset != _block_offset);
+    return !_discard;
+  }
+
+  void cancelBlock(void)
+  {
+    ++_broken_count;
+    drop_block();
+  }
+
+  static std::size_t IRAM_ATTR receiving_offset(void)
+  {
+    return _discard ? _discard_offset : _block_offset;
+  }
+
+  bool IRAM_ATTR needData(void)
+  {
+    return (_bufindex < _block_size && receiving_offset() + _bufindex < _totalsize && !_decode_error);
+  }
+
+  std::size_t IRAM_ATTR addData(const std::uint8_t* data, std::size_t len)
+  {
+    if (!needData()) { return 0; }
+    len = std::min(len, std::min(_block_size - _bufindex, _totalsize - receiving_offset() - _bufindex));
+    if (_discard)
     {
-      info->status = write_info_t::status_t::ok;
+      _bufindex += len;
+      return len;
     }
-    vTaskDelete(nullptr);
+    _calc_crc32 = crc::calc32(_calc_crc32, data, len);
+    if (_format != format_raw)
+    {
+      memcpy(&_zbuffer[_bufindex], data, len);
+      _bufindex += len;
+      return len;
+    }
+    /// 無圧縮ではセクタバッファへ詰め、埋まったセクタはブロックの続きが届いた時点で書込みへ回す。
+    /// ブロック最後のセクタはCRCを確認するまで保持する (4KBブロックでは確認前に書込むことはない)
+    std::size_t remain = len;
+    do
+    {
+      if (_secindex == SPI_FLASH_SEC_SIZE)
+      {
+        queue_sector(_block_offset + _bufindex - SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+        _secindex = 0;
+      }
+      std::size_t l = std::min(remain, SPI_FLASH_SEC_SIZE - _secindex);
+      memcpy(&_buffer[_secindex], data, l);
+      _secindex += l;
+      _bufindex += l;
+      data += l;
+      remain -= l;
+    } while (remain);
+    return len;
+  }
+
+  static bool IRAM_ATTR checkCRC32(void)
+  {
+    return !_discard && _crc32 == _calc_crc32;
+  }
+
+  /// 未消去の範囲を消去済みにする。書込みが先行消去に追い付いた場合は間の範囲もまとめて消去する
+  static bool erase_until(std::size_t end)
+  {
+    if (end <= _erase_pos) { return true; }
+    bool res = (ESP_OK == esp_partition_erase_range(_partition, _erase_pos, end - _erase_pos));
+    _erase_pos = end;
+    return res;
   }
 
+  /// 書込み済みの範囲を end まで読み戻してハッシュに加える。
+  /// パテーション先頭16バイトは end() まで0xFFのままのため、退避しておいた内容を使う
+  static bool sha_update(std::size_t end)
+  {
+    std::size_t pos = _sha_pos;
+    if (pos < SKIP_SIZE)
+    {
+      std::size_t l = std::min(end, SKIP_SIZE);
+      mbedtls_sha256_update(&_sha, &_header_buffer[pos], l - pos);
+      pos = l;
+    }
+    if (pos < end)
+    {
+      const void* ptr;
+      spi_flash_mmap_handle_t handle;
+      if (ESP_OK != esp_partition_mmap(_partition, pos, end - pos, SPI_FLASH_MMAP_DATA, &ptr, &handle))
+      {
+        return false;
+      }
+      mbedtls_sha256_update(&_sha, (const unsigned char*)ptr, end - pos);
+      spi_flash_munmap(handle);
+    }
+    _sha_pos = end;
+    return true;
+  }
+
+  /// ハッシュの計算を1セクタ分進める。イメージの末尾まで計算したら結果を確定する
+  static void sha_step(void)
+  {
+    if (_sha_restart)
+    {
+      _sha_restart = false;
+      if (_sha_active) { mbedtls_sha256_free(&_sha); }
+      mbedtls_sha256_init(&_sha);
+      mbedtls_sha256_starts(&_sha, 0);
+      _sha_active = true;
+      return;
+    }
+    if (!_sha_active) { return; }
+    std::size_t limit = _sha_limit;
+    std::size_t next = (_sha_pos & ~(SPI_FLASH_SEC_SIZE - 1)) + SPI_FLASH_SEC_SIZE;
+    if (!sha_update(std::min(limit, next)))
+    {
+      _sha_error = true;
+    }
+    if (_sha_error || _sha_pos == _image_size)
+    {
+      mbedtls_sha256_finish(&_sha, _sha_digest);
+      mbedtls_sha256_free(&_sha);
+      _sha_active = false;
+      _sha_done = !_sha_error;
+    }
+  }
+
+  /// 常駐する書込みタスク。書込み要求を優先して処理し、要求がない間は書き終えた範囲のハッシュを計算し、
+  /// 残りの時間で書込み先の範囲を1セクタずつ先行して消去する
+  static void writerTask(void*)
+  {
+    for (;;)
+    {
+      _writer_busy = true;
+      if (_job_getpos != _job_setpos)
+      {
+        auto info = &_jobs[_job_getpos];
+        if ((!info->finish && !erase_until(info->offset + SPI_FLASH_SEC_SIZE))
+         || (ESP_OK != esp_partition_write(_partition, info->offset, info->buffer, info->len))
+         || (info->finish && (ESP_OK != esp_ota_set_boot_partition(_partition))))
+        {
+          _write_error = true;
+          info->status = write_info_t::status_t::error;
+        }
+        else
+        {
+          info->status = write_info_t::status_t::ok;
+        }
+        _job_getpos = (_job_getpos + 1) % BUFFER_COUNT;
+      }
+      else
+      if (_sha_restart || (_sha_active && _sha_pos < _sha_limit))
+      {
+        sha_step();
+      }
+      else
+      if (_erase_pos < _erase_end)
+      {
+        if (!erase_until(_erase_pos + SPI_FLASH_SEC_SIZE))
+        {
+          _write_error = true;
+        }
+      }
+      else
+      {
+        _writer_busy = false;
+        xSemaphoreGive(_writer_event);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        continue;
+      }
+      xSemaphoreGive(_writer_event);
+    }
+  }
+
+  /// 書込み要求を積む。キューが埋まっている場合のみ空きが出るまで待つ
   static bool write(std::uint8_t* buf, std::size_t offset, std::size_t len, bool finish)
   {
-    write_info_t info;
-    info.buffer = buf;
-    info.offset = offset;
-    info.len = len;
-    info.finish = finish;
+    std::size_t next = (_job_setpos + 1) % BUFFER_COUNT;
+    while (next == _job_getpos) { wait_writer(); }
 
-    /// Core1で書き込みを行うとクラッシュする事があるためCore0で書き込みを行う
-    xTaskCreatePinnedToCore(writeTask, "writeTask", 4096, &info, 2, nullptr, 0);
-    while (info.status == write_info_t::status_t::none) taskYIELD();
-    return info.status == write_info_t::status_t::ok;
+    auto info = &_jobs[_job_setpos];
+    info->buffer = buf;
+    info->offset = offset;
+    info->len = len;
+    info->finish = finish;
+    info->status = write_info_t::status_t::pending;
+    _job_setpos = next;
+    xTaskNotifyGive(_writer_task);
+    return !_write_error;
   }
 
-  bool writeBuffer(std::size_t offset)
+  /// 積んだ書込み要求がすべて完了するまで待つ
+  static bool wait_jobs(void)
   {
-    auto len = _bufindex;
-    if (!len) return false;
+    while (_job_getpos != _job_setpos) { wait_writer(); }
+    return !_write_error;
+  }
 
+  /// セクタバッファの内容を書込みタスクへ渡し、以降はもう一方のバッファを使う
+  static bool queue_sector(std::size_t offset, std::size_t len)
+  {
     if (offset == 0)
     {
     /// パテーション先頭16バイトを退避して0xFF埋めしておく
@@ -138,13 +546,143 @@ namespace update
       memcpy(_header_buffer, _buffer, SKIP_SIZE);
       memset(_buffer, 0xFF, SKIP_SIZE);
     }
-    return write(_buffer, offset, len, false);
+    bool res = write(_buffer, offset, len, false);
+    _buffer_select = (_buffer_select + 1) % BUFFER_COUNT;
+    _buffer = _buffers[_buffer_select];
+    return res;
+  }
+
+  /// 展開したセクタを書込みに回す。CRCは先頭16バイトを退避する前の内容で計算する
+  static void image_flush(void)
+  {
+    _image_crc = crc::calc32(_image_crc, _buffer, _outindex);
+    if (!queue_sector(_flushed, _outindex)) { _decode_error = true; }
+    _flushed += _outindex;
+    _outindex = 0;
   }
 
-  bool IRAM_ATTR end(void)
+  bool image_sink_t::put(std::uint8_t value)
   {
+    _buffer[_outindex] = value;
+    if (++_outindex == SPI_FLASH_SEC_SIZE) { image_flush(); }
+    return !_decode_error;
+  }
+
+  /// 複写命令 : 実行中のパーティションからセクタバッファへ直接読出す
+  bool image_sink_t::copy(std::size_t src, std::size_t len)
+  {
+    while (len)
+    {
+      std::size_t l = std::min(len, SPI_FLASH_SEC_SIZE - _outindex);
+      if (ESP_OK != esp_partition_read(_base_partition, src, &_buffer[_outindex], l)) { return false; }
+      _outindex += l;
+      src += l;
+      len -= l;
+      if (_outindex == SPI_FLASH_SEC_SIZE) { image_flush(); }
+    }
+    return !_decode_error;
+  }
+
+  /// 差分の元になる実行中のイメージが、パッチ作成時のものと一致するか確認する。
+  /// 最初の命令より前に呼ばれるため、まだ何も展開していないセクタバッファを読出しに使う
+  bool image_sink_t::check_base(std::size_t size, std::uint32_t crc32)
+  {
+    if (size > _base_partition->size) { return false; }
+    std::uint32_t crc = crc::CRC32_INIT;
+    for (std::size_t pos = 0; pos < size; pos += SPI_FLASH_SEC_SIZE)
+    {
+      std::size_t len = std::min<std::size_t>(SPI_FLASH_SEC_SIZE, size - pos);
+      if (ESP_OK != esp_partition_read(_base_partition, pos, _buffer, len)) { return false; }
+      crc = crc::calc32(crc, _buffer, len);
+    }
+    return crc == crc32;
+  }
+
+  /// 受信した圧縮/差分ブロックを展開してセクタバッファへ詰め、埋まったセクタから書込みに回す。
+  /// 最終ブロックでは端数のセクタを書込み、展開後のイメージ全体のCRCを末尾の値と照合する
+  static bool decode_block(std::size_t len)
+  {
+    if (_decode_error) { return false; }
+    if (!_decoder.input(_zbuffer, len))
+    {
+      if (_decoder.base_error()) { ESP_EARLY_LOGE(LOGNAME, "OTA delta base mismatch"); }
+      _decode_error = true;
+      return false;
+    }
+    if (_decoder.finished())
+    {
+      if (_outindex) { image_flush(); }
+      _image_ok = !_decode_error && _decoder.outsize() == _image_size && _image_crc == _decoder.trailer_crc();
+      if (!_image_ok)
+      {
+        ESP_EARLY_LOGE(LOGNAME, "OTA image CRC mismatch");
+        return false;
+      }
+    }
+    return !_decode_error && !_write_error;
+  }
+
+  /// 受信を終えたブロックを書込みタスクへ渡し、次のブロックの受信に備える。
+  /// 書込みの完了は待たないため、書込みの失敗は以降の finishBlock / end の戻り値で通知される
+  static bool write_block(void)
+  {
+    auto len = _bufindex;
+    if (!len) return false;
+
+    bool res;
+    if (_format != format_raw)
+    { /// 圧縮/差分形式では書込み先の位置は展開後の位置で決まる
+      res = decode_block(len);
+      advance_sha(_flushed);
+    }
+    else
+    {
+      res = queue_sector(_block_offset + _bufindex - _secindex, _secindex);
+      advance_sha(_block_offset + len);
+    }
+    _block_offset += len;
+    _bufindex = 0;
+    _secindex = 0;
+    return res;
+  }
+
+  block_result_t finishBlock(void)
+  {
+    if (_discard || !checkCRC32())
+    {
+      ++_broken_count;
+      drop_block();
+      return block_broken;
+    }
+    return write_block() ? block_ok : block_error;
+  }
+
+  bool IRAM_ATTR end(const std::uint8_t* sha256)
+  {
+    /// 書込みタスクが動いていなければハッシュの計算を待てないため、更新を始めていない場合は何もしない
+    if (!_started) { return false; }
+
+    /// 圧縮/差分形式で展開後のイメージ全体を確認できていなければ起動先を切替えない
+    if (_format != format_raw && !_image_ok) { return false; }
+
+    /// 全セクタの書込み完了を待つ
+    if (!wait_jobs()) { return false; }
+
+    if (sha256)
+    { /// 書込みの合間に計算を進めているため、ここでは最後のブロックの分の計算を待つのみとなる
+      /// (再開時に末尾の一致済みセクタを読み飛ばした場合も、イメージの末尾まで計算させる)
+      advance_sha(_image_size);
+      while (!_sha_done && !_sha_error) { wait_writer(); }
+      if (_sha_error || memcmp(_sha_digest, sha256, SHA256_SIZE))
+      {
+        ESP_EARLY_LOGE(LOGNAME, "OTA image SHA-256 mismatch");
+        return false;
+      }
+    }
+
     /// 退避しておいたパテーション先頭16バイト分のデータを書き込む
-    return write(_header_buffer, 0, SKIP_SIZE, true);
+    return write(_header_buffer, 0, SKIP_SIZE, true)
+        && wait_jobs();
   }
 
 };
\ No newline at end of file
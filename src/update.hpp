@@ -5,11 +5,55 @@
 
 namespace update
 {
-  void initCRCtable(void);
-  bool begin(std::size_t totalsize);
-  bool writeBuffer(std::size_t sector);
-  bool addData(std::uint8_t data);
+  /// 受信するイメージの形式
+  enum format_t
+  { format_raw   // 無圧縮 : 受信したデータをそのまま書込む
+  , format_lz    // LZSS圧縮 : 展開しながら書込む。末尾4Byteは展開後のイメージ全体のCRC32 (ビッグエンディアン)
+  , format_delta // 差分 : 実行中のパーティションからの複写と挿入の命令列。末尾4Byteはformat_lzと同じ
+  };
+
+  /// ブロックの受信を終えた時の結果
+  enum block_result_t
+  { block_ok      // 書込みへ回した
+  , block_broken  // CRCが一致しない、または順番の合わないブロックのため破棄した (送り直しが必要)
+  , block_error   // 書込みまたは展開に失敗した
+  };
+
+  /// totalsize:受信するデータのサイズ image_size:展開後のサイズ (format_raw以外で使用)
+  bool begin(std::size_t totalsize, format_t format = format_raw, std::size_t image_size = 0);
+  /// 書込み先の内容を残したまま無圧縮の更新を始める (一致しているセクタは seek で読み飛ばす)
+  bool resume(std::size_t totalsize);
+  /// 次に受信するブロックの書込み位置をセクタ境界の offset へ移す (format_rawのみ)
+  bool seek(std::size_t offset);
+  /// 書込み先パーティションの sector から count セクタ分の内容のCRC32を result へ格納する
+  bool hashSectors(std::size_t sector, std::size_t count, std::uint32_t* result);
+  /// ブロックのデータをまとめてバッファへ追加し、追加したByte数を返す (ブロックの残りを超える分は追加しない)
+  std::size_t addData(const std::uint8_t* data, std::size_t len);
+  /// 現在のブロックにまだデータが必要かどうか
+  bool needData(void);
+  /// 次のブロックのCRC32を設定する (ブロックは受信済みの位置の続きとして扱う)
   void setBlockCRC32(std::uint32_t crc32);
-  bool checkCRC32(void);
-  bool end(void);
+  /// 順番付きのブロックの受信を始める。sequence番目のブロックが受信済みの位置の続きでなければ読み捨てて false を返す
+  bool setBlock(std::size_t sequence, std::uint32_t crc32);
+  /// 順番付きのブロックが途中で途切れた場合に呼ぶ。受信途中のブロックを破棄し、送り直しを待つ
+  void cancelBlock(void);
+  /// ブロックの受信を終えた時に呼ぶ。CRCが一致すれば書込みに回す
+  block_result_t finishBlock(void);
+
+  /// ブロックのサイズ (4KB/16KB/64KB) を変更し、変更後のサイズを返す。begin 直後、最初のブロックより前のみ変更できる
+  std::size_t setBlockSize(std::size_t size);
+  std::size_t getBlockSize(void);
+  /// 応答を待たずに送信してよいブロック数。buffered:受信データをupdateへ渡す前に溜めておけるByte数
+  std::size_t getWindow(std::size_t buffered);
+  /// 次に受付けるブロックの順番 (受信を終えたブロック数)
+  std::size_t getNextSequence(void);
+  /// 次に受付けるブロックの受信データ内の位置
+  std::size_t getPosition(void);
+  /// 書込みタスクが処理待ちの書込み要求の数
+  std::size_t getPendingWrites(void);
+  /// 破棄したブロックの数
+  std::size_t getBrokenCount(void);
+  /// 書込みを終えて起動先を切替える。sha256 (32Byte) を指定した場合は書込んだイメージ全体を読み戻して照合し、
+  /// 一致しなければ起動先を切替えない
+  bool end(const std::uint8_t* sha256 = nullptr);
 }